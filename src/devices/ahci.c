@@ -0,0 +1,778 @@
+#include "devices/ahci.h"
+#include <ctype.h>
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a driver for SATA disks attached to
+   an AHCI host bus adapter [AHCI], such as QEMU's "ich9-ahci".
+
+   Each port has a list of command slots.  A disk that supports
+   native command queuing [SATA] gets one outstanding READ or WRITE
+   FPDMA QUEUED command per slot, up to AHCI_QUEUE_DEPTH of them,
+   and reports each one done separately, in whatever order it
+   likes; the block layer keeps that many dispatcher threads busy
+   on the disk (see block_set_queue_depth()).  Other disks get one
+   command at a time.  Data moves by DMA, through a physical region
+   descriptor table in each slot's command table. */
+
+/* PCI class of an AHCI controller. */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_PROG_IF_AHCI 0x01
+
+/* HBA port registers. */
+struct port_regs
+  {
+    uint32_t clb;               /* Command list base address. */
+    uint32_t clbu;              /* Upper 32 bits of CLB. */
+    uint32_t fb;                /* Received FIS base address. */
+    uint32_t fbu;               /* Upper 32 bits of FB. */
+    uint32_t is;                /* Interrupt status; write 1 to clear. */
+    uint32_t ie;                /* Interrupt enable. */
+    uint32_t cmd;               /* Command and status. */
+    uint32_t reserved0;
+    uint32_t tfd;               /* Task file data. */
+    uint32_t sig;               /* Device signature. */
+    uint32_t ssts;              /* SATA status. */
+    uint32_t sctl;              /* SATA control. */
+    uint32_t serr;              /* SATA error; write 1 to clear. */
+    uint32_t sact;              /* Queued commands still active. */
+    uint32_t ci;                /* Commands issued. */
+    uint32_t sntf;              /* SATA notification. */
+    uint32_t fbs;               /* FIS-based switching control. */
+    uint32_t reserved1[15];
+  };
+
+/* HBA memory registers, at the address in BAR 5. */
+struct hba_regs
+  {
+    uint32_t cap;               /* Host capabilities. */
+    uint32_t ghc;               /* Global host control. */
+    uint32_t is;                /* Interrupt status, one bit per port. */
+    uint32_t pi;                /* Ports implemented. */
+    uint32_t vs;                /* Version. */
+    uint8_t reserved[0x100 - 0x14];
+    struct port_regs ports[32];
+  };
+
+/* Host Capabilities bits. */
+#define CAP_NCS(CAP) ((((CAP) >> 8) & 0x1f) + 1)  /* Command slots. */
+#define CAP_SNCQ 0x40000000     /* Supports native command queuing. */
+
+/* Global Host Control bits. */
+#define GHC_IE 0x00000002       /* Interrupt enable. */
+#define GHC_AE 0x80000000       /* AHCI enable. */
+
+/* Port Command bits. */
+#define PORT_CMD_ST 0x0001      /* Start processing the command list. */
+#define PORT_CMD_FRE 0x0010     /* FIS receive enable. */
+#define PORT_CMD_FR 0x4000      /* FIS receive running. */
+#define PORT_CMD_CR 0x8000      /* Command list running. */
+
+/* Port Interrupt Status and Enable bits. */
+#define PORT_IS_DHRS 0x00000001 /* Device to host register FIS. */
+#define PORT_IS_PSS 0x00000002  /* PIO setup FIS. */
+#define PORT_IS_SDBS 0x00000008 /* Set device bits FIS. */
+#define PORT_IS_DPS 0x00000020  /* Descriptor processed. */
+#define PORT_IS_ERROR 0x78000000 /* Task file, host bus, and
+                                    interface errors. */
+
+/* Task File Data status bits. */
+#define TFD_BSY 0x80            /* Busy. */
+#define TFD_DRQ 0x08            /* Data request. */
+
+/* SATA Status device detection, and the signature of an ATA
+   disk. */
+#define SSTS_DET(SSTS) ((SSTS) & 0xf)
+#define SSTS_DET_PRESENT 3      /* Device present, link up. */
+#define SIG_ATA 0x00000101
+
+/* Commands. */
+#define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
+#define CMD_READ_DMA_EXT 0x25           /* READ DMA EXT. */
+#define CMD_WRITE_DMA_EXT 0x35          /* WRITE DMA EXT. */
+#define CMD_READ_FPDMA_QUEUED 0x60      /* READ FPDMA QUEUED. */
+#define CMD_WRITE_FPDMA_QUEUED 0x61     /* WRITE FPDMA QUEUED. */
+
+/* Device register bits. */
+#define DEV_LBA 0x40            /* Linear based addressing. */
+
+/* Most sectors moved by one command.  A count of 0 means 65,536
+   for the 48-bit commands we use, but we stay below that. */
+#define MAX_SECTORS_PER_COMMAND 65535
+
+/* A command list entry. */
+struct cmd_header
+  {
+    uint16_t flags;             /* CH_* and FIS length in dwords. */
+    uint16_t prdtl;             /* PRD table length in entries. */
+    uint32_t prdbc;             /* Bytes transferred. */
+    uint32_t ctba;              /* Command table base address. */
+    uint32_t ctbau;             /* Upper 32 bits of CTBA. */
+    uint32_t reserved[4];
+  };
+#define CH_CFL (sizeof (struct fis_h2d) / 4)  /* Command FIS length. */
+#define CH_WRITE 0x0040         /* Device reads from memory. */
+
+/* A host to device register FIS. */
+struct fis_h2d
+  {
+    uint8_t type;               /* FIS_TYPE_H2D. */
+    uint8_t flags;              /* FIS_H2D_C for a command. */
+    uint8_t command;            /* ATA command. */
+    uint8_t featurel;           /* Features 7:0. */
+    uint8_t lba0, lba1, lba2;   /* LBA 23:0. */
+    uint8_t device;             /* Device register. */
+    uint8_t lba3, lba4, lba5;   /* LBA 47:24. */
+    uint8_t featureh;           /* Features 15:8. */
+    uint8_t countl;             /* Count 7:0. */
+    uint8_t counth;             /* Count 15:8. */
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+  };
+#define FIS_TYPE_H2D 0x27
+#define FIS_H2D_C 0x80
+
+/* A physical region descriptor. */
+struct ahci_prd
+  {
+    uint32_t dba;               /* Physical address of region. */
+    uint32_t dbau;              /* Upper 32 bits of DBA. */
+    uint32_t reserved;
+    uint32_t dbc;               /* Size in bytes, minus 1. */
+  };
+#define PRD_MAX_SIZE 0x400000   /* Largest region, 4 MB. */
+
+/* Physical region descriptors per command.  Makes a command table
+   512 bytes, a multiple of the 128 bytes AHCI wants it aligned
+   to. */
+#define PRD_CNT 24
+
+/* A command table. */
+struct cmd_table
+  {
+    union
+      {
+        struct fis_h2d h2d;
+        uint8_t raw[64];
+      }
+    cfis;                       /* Command FIS. */
+    uint8_t acmd[16];           /* ATAPI command. */
+    uint8_t reserved[48];
+    struct ahci_prd prd[PRD_CNT];
+  };
+
+/* Most command slots a port has. */
+#define SLOT_MAX 32
+
+/* Pages holding a port's command tables. */
+#define TABLE_PAGES DIV_ROUND_UP (SLOT_MAX * sizeof (struct cmd_table), PGSIZE)
+
+/* Most queued commands we keep in flight on one disk.  Each one
+   has a block-layer dispatcher thread, at a page of kernel memory
+   apiece, and deeper queues buy little under emulation. */
+#define AHCI_QUEUE_DEPTH 8
+
+/* An AHCI host bus adapter. */
+struct hba
+  {
+    volatile struct hba_regs *regs;     /* Memory registers. */
+    uint8_t irq;                /* PCI interrupt line. */
+  };
+
+/* A SATA disk on one port of an HBA. */
+struct ahci_disk
+  {
+    char name[8];               /* Name, e.g. "sda". */
+    struct hba *hba;            /* HBA it is attached to. */
+    int port_no;                /* Port number, 0...31. */
+    volatile struct port_regs *regs;    /* Port registers. */
+    bool ncq;                   /* Use native command queuing? */
+    int slot_cnt;               /* Command slots we use. */
+
+    struct cmd_header *cmd_list;        /* Command list. */
+    struct cmd_table *tables;   /* Command table for each slot. */
+    struct semaphore done[SLOT_MAX];    /* Up'd when slot completes. */
+
+    struct lock lock;           /* Protects BUSY_SLOTS. */
+    struct condition slot_free; /* Signaled when a slot is freed. */
+    uint32_t busy_slots;        /* Slots owned by a transfer. */
+
+    uint32_t issued;            /* Slots issued and not yet complete.
+                                   Shared with interrupt handler. */
+  };
+
+/* We support a couple of HBAs, and a few disks on them, named
+   sda, sdb, ... in PCI and port order. */
+#define MAX_HBAS 2
+#define MAX_DISKS 4
+static struct hba hbas[MAX_HBAS];
+static size_t hba_cnt;
+static struct ahci_disk disks[MAX_DISKS];
+static size_t disk_cnt;
+
+static struct block_operations ahci_operations;
+
+static bool setup_hba (struct hba *, struct pci_addr);
+static bool setup_port (struct ahci_disk *);
+static void identify_ata_device (struct ahci_disk *);
+static char *descramble_ata_string (char *, int size);
+static void issue_command (struct ahci_disk *, const struct fis_h2d *,
+                           const struct block_iov *, size_t iov_cnt,
+                           size_t *used, bool write);
+static void interrupt_handler (void *hba);
+
+/* Finds AHCI controllers on the PCI bus and registers the ATA
+   disks attached to them. */
+void
+ahci_init (void)
+{
+  struct pci_addr a;
+  int n;
+
+  for (n = 0; hba_cnt < MAX_HBAS
+         && pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, n, &a);
+       n++)
+    {
+      struct hba *h = &hbas[hba_cnt];
+      uint32_t pi;
+      int port_no;
+
+      if (pci_read8 (a, PCI_REG_PROG_IF) != PCI_PROG_IF_AHCI
+          || !setup_hba (h, a))
+        continue;
+      hba_cnt++;
+
+      pci_register_irq (h->irq, interrupt_handler, h);
+      h->regs->ghc |= GHC_IE;
+
+      pi = h->regs->pi;
+      for (port_no = 0; port_no < 32 && disk_cnt < MAX_DISKS; port_no++)
+        {
+          struct ahci_disk *d = &disks[disk_cnt];
+
+          if (!(pi & (1u << port_no)))
+            continue;
+          snprintf (d->name, sizeof d->name, "sd%c", 'a' + (int) disk_cnt);
+          d->hba = h;
+          d->port_no = port_no;
+          d->regs = &h->regs->ports[port_no];
+          if (setup_port (d))
+            {
+              disk_cnt++;
+              identify_ata_device (d);
+            }
+        }
+    }
+}
+
+/* Enables the AHCI controller at A and maps its registers into
+   H.  Returns true if successful, false if it is unusable. */
+static bool
+setup_hba (struct hba *h, struct pci_addr a)
+{
+  uint32_t abar = pci_bar (a, 5);
+  uint8_t irq = pci_read8 (a, PCI_REG_IRQ);
+
+  if (abar == 0 || irq >= 16)
+    return false;
+  pci_write16 (a, PCI_REG_COMMAND,
+               pci_read16 (a, PCI_REG_COMMAND)
+               | PCI_CMD_MEMORY | PCI_CMD_MASTER);
+  h->regs = pci_map_mem (abar, sizeof (struct hba_regs));
+  h->irq = irq;
+  h->regs->ghc |= GHC_AE;
+  return true;
+}
+
+/* Waits up to 500 ms for the bits in MASK to clear in *REG.
+   Returns true if they did, false if they did not. */
+static bool
+wait_clear (volatile uint32_t *reg, uint32_t mask)
+{
+  int i;
+
+  for (i = 0; i < 500; i++)
+    {
+      if (!(*reg & mask))
+        return true;
+      timer_msleep (1);
+    }
+  return false;
+}
+
+/* Sets up the port for disk D, if an ATA disk is attached to it:
+   stops the port, gives it a command list, a received FIS area,
+   and command tables, and starts it again.  Returns true if
+   successful, false if there is no usable disk on the port. */
+static bool
+setup_port (struct ahci_disk *d)
+{
+  volatile struct port_regs *p = d->regs;
+  uint8_t *mem;
+  int slot;
+
+  if (SSTS_DET (p->ssts) != SSTS_DET_PRESENT || p->sig != SIG_ATA)
+    return false;
+
+  /* Stop the port, which firmware may have left running. */
+  p->cmd &= ~PORT_CMD_ST;
+  if (!wait_clear (&p->cmd, PORT_CMD_CR))
+    return false;
+  p->cmd &= ~PORT_CMD_FRE;
+  if (!wait_clear (&p->cmd, PORT_CMD_FR))
+    return false;
+
+  /* The command list, 1 kB aligned, and the received FIS area,
+     256-byte aligned, share a page.  Command tables follow in
+     pages of their own. */
+  mem = palloc_get_page (PAL_ZERO);
+  d->tables = palloc_get_multiple (PAL_ZERO, TABLE_PAGES);
+  if (mem == NULL || d->tables == NULL)
+    {
+      printf ("%s: out of memory for command list\n", d->name);
+      palloc_free_page (mem);
+      palloc_free_multiple (d->tables, TABLE_PAGES);
+      return false;
+    }
+  d->cmd_list = (struct cmd_header *) mem;
+  for (slot = 0; slot < SLOT_MAX; slot++)
+    {
+      d->cmd_list[slot].ctba = vtop (&d->tables[slot]);
+      sema_init (&d->done[slot], 0);
+    }
+  lock_init (&d->lock);
+  cond_init (&d->slot_free);
+  d->busy_slots = 0;
+  d->issued = 0;
+  d->ncq = false;
+  d->slot_cnt = 1;
+
+  p->clb = vtop (d->cmd_list);
+  p->clbu = 0;
+  p->fb = vtop (mem + 1024);
+  p->fbu = 0;
+  p->serr = 0xffffffff;
+  p->is = 0xffffffff;
+  p->ie = (PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_SDBS | PORT_IS_DPS
+           | PORT_IS_ERROR);
+
+  /* Start it again, once the disk is ready for commands. */
+  p->cmd |= PORT_CMD_FRE;
+  if (!wait_clear (&p->tfd, TFD_BSY | TFD_DRQ))
+    {
+      /* Stop FIS reception and detach the port from our memory
+         before freeing it, so the HBA cannot write into it.  If
+         the port will not stop, leaking the memory is safer. */
+      printf ("%s: disk not ready\n", d->name);
+      p->ie = 0;
+      p->cmd &= ~PORT_CMD_FRE;
+      if (wait_clear (&p->cmd, PORT_CMD_FR))
+        {
+          p->clb = 0;
+          p->fb = 0;
+          palloc_free_page (mem);
+          palloc_free_multiple (d->tables, TABLE_PAGES);
+        }
+      d->cmd_list = NULL;
+      d->tables = NULL;
+      return false;
+    }
+  p->cmd |= PORT_CMD_ST;
+  return true;
+}
+
+/* Sends an IDENTIFY DEVICE command to disk D and reads the
+   response.  Decides whether to use native command queuing and
+   registers the disk with the block device layer. */
+static void
+identify_ata_device (struct ahci_disk *d)
+{
+  char id[BLOCK_SECTOR_SIZE];
+  const uint16_t *words = (const uint16_t *) id;
+  struct fis_h2d fis;
+  struct block_iov iov;
+  block_sector_t capacity;
+  char *model, *serial;
+  char extra_info[128];
+  struct block *block;
+  size_t used;
+
+  memset (&fis, 0, sizeof fis);
+  fis.command = CMD_IDENTIFY_DEVICE;
+  iov.buffer = id;
+  iov.cnt = 1;
+  used = 0;
+  issue_command (d, &fis, &iov, 1, &used, false);
+
+  /* Calculate capacity, from the 48-bit sector count if the disk
+     has one.  Read model name and serial number. */
+  if (words[83] & (1 << 10))
+    capacity = (words[101] != 0 || words[102] != 0 || words[103] != 0
+                ? UINT32_MAX : *(uint32_t *) &words[100]);
+  else
+    capacity = *(uint32_t *) &words[60];
+  model = descramble_ata_string (&id[10 * 2], 20);
+  serial = descramble_ata_string (&id[27 * 2], 40);
+  snprintf (extra_info, sizeof extra_info,
+            "model \"%s\", serial \"%s\"", model, serial);
+
+  /* Queue commands if both the HBA and the disk can, up to
+     AHCI_QUEUE_DEPTH of them.  The disk reports its queue depth
+     minus 1. */
+  if ((d->hba->regs->cap & CAP_SNCQ) && (words[76] & (1 << 8)))
+    {
+      d->ncq = true;
+      d->slot_cnt = CAP_NCS (d->hba->regs->cap);
+      if (d->slot_cnt > (words[75] & 0x1f) + 1)
+        d->slot_cnt = (words[75] & 0x1f) + 1;
+      if (d->slot_cnt > AHCI_QUEUE_DEPTH)
+        d->slot_cnt = AHCI_QUEUE_DEPTH;
+      snprintf (extra_info + strlen (extra_info),
+                sizeof extra_info - strlen (extra_info),
+                ", NCQ depth %d", d->slot_cnt);
+    }
+
+  /* Register. */
+  block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
+                          &ahci_operations, d);
+  block_set_queue_depth (block, d->slot_cnt);
+  partition_scan (block);
+}
+
+/* Translates STRING, which consists of SIZE bytes in a funky
+   format, into a null-terminated string in-place.  Drops
+   trailing whitespace and null bytes.  Returns STRING.  */
+static char *
+descramble_ata_string (char *string, int size)
+{
+  int i;
+
+  /* Swap all pairs of bytes. */
+  for (i = 0; i + 1 < size; i += 2)
+    {
+      char tmp = string[i];
+      string[i] = string[i + 1];
+      string[i + 1] = tmp;
+    }
+
+  /* Find the last non-white, non-null character. */
+  for (size--; size > 0; size--)
+    {
+      int c = string[size - 1];
+      if (c != '\0' && !isspace (c))
+        break;
+    }
+  string[size] = '\0';
+
+  return string;
+}
+
+/* Command issue and completion. */
+
+/* Waits for a free command slot on disk D, claims it, and
+   returns its number. */
+static int
+alloc_slot (struct ahci_disk *d)
+{
+  int slot;
+
+  lock_acquire (&d->lock);
+  for (;;)
+    {
+      for (slot = 0; slot < d->slot_cnt; slot++)
+        if (!(d->busy_slots & (1u << slot)))
+          {
+            d->busy_slots |= 1u << slot;
+            lock_release (&d->lock);
+            return slot;
+          }
+      cond_wait (&d->slot_free, &d->lock);
+    }
+}
+
+/* Releases command slot SLOT on disk D. */
+static void
+free_slot (struct ahci_disk *d, int slot)
+{
+  lock_acquire (&d->lock);
+  d->busy_slots &= ~(1u << slot);
+  cond_signal (&d->slot_free, &d->lock);
+  lock_release (&d->lock);
+}
+
+/* Adds the SIZE bytes at BUFFER to the *PRD_CNT regions in
+   TABLE, extending the last region where the memory is
+   physically contiguous with it.  Returns false, adding nothing,
+   if that would take more than PRD_CNT regions.  BUFFER must be
+   in kernel memory, which is physically contiguous, and 2-byte
+   aligned. */
+static bool
+add_prd (struct cmd_table *table, size_t *prd_cnt,
+         const void *buffer, size_t size)
+{
+  uint32_t addr = vtop (buffer);
+  struct ahci_prd *last = *prd_cnt > 0 ? &table->prd[*prd_cnt - 1] : NULL;
+
+  ASSERT (is_kernel_vaddr (buffer) && ((uintptr_t) buffer & 1) == 0);
+  ASSERT (size <= PRD_MAX_SIZE);
+
+  if (last != NULL && last->dba + last->dbc + 1 == addr
+      && last->dbc + 1 + size <= PRD_MAX_SIZE)
+    last->dbc += size;
+  else if (*prd_cnt < PRD_CNT)
+    {
+      last = &table->prd[(*prd_cnt)++];
+      last->dba = addr;
+      last->dbau = 0;
+      last->dbc = size - 1;
+    }
+  else
+    return false;
+  return true;
+}
+
+/* Issues command FIS on disk D with a data phase covering as much
+   of the IOV_CNT segments of IOV as fits into one command,
+   starting USED sectors into them, and waits for it to complete.
+   Data moves into memory if WRITE is false, out of it if WRITE is
+   true.  Advances *USED past the sectors moved.  Fills in the
+   sector count of a READ or WRITE command; FIS's other fields
+   must already be set. */
+static void
+issue_command (struct ahci_disk *d, const struct fis_h2d *fis,
+               const struct block_iov *iov, size_t iov_cnt,
+               size_t *used, bool write)
+{
+  int slot = alloc_slot (d);
+  uint32_t bit = 1u << slot;
+  struct cmd_table *table = &d->tables[slot];
+  struct cmd_header *header = &d->cmd_list[slot];
+  struct fis_h2d *cfis = &table->cfis.h2d;
+  bool queued = (fis->command == CMD_READ_FPDMA_QUEUED
+                 || fis->command == CMD_WRITE_FPDMA_QUEUED);
+  size_t prd_cnt = 0;
+  size_t skip = *used;
+  size_t cnt = 0;
+  enum intr_level old_level;
+  size_t i;
+
+  /* Gather whole sectors from the segments, skipping the ones
+     already moved. */
+  for (i = 0; i < iov_cnt; i++)
+    {
+      uint8_t *buffer = iov[i].buffer;
+      size_t seg_cnt = iov[i].cnt;
+
+      if (skip >= seg_cnt)
+        {
+          skip -= seg_cnt;
+          continue;
+        }
+      buffer += skip * BLOCK_SECTOR_SIZE;
+      seg_cnt -= skip;
+      skip = 0;
+      if (seg_cnt > MAX_SECTORS_PER_COMMAND - cnt)
+        seg_cnt = MAX_SECTORS_PER_COMMAND - cnt;
+      if (!add_prd (table, &prd_cnt, buffer, seg_cnt * BLOCK_SECTOR_SIZE))
+        break;
+      cnt += seg_cnt;
+      if (cnt == MAX_SECTORS_PER_COMMAND)
+        break;
+    }
+  ASSERT (iov_cnt == 0 || cnt > 0);
+  *used += cnt;
+
+  *cfis = *fis;
+  cfis->type = FIS_TYPE_H2D;
+  cfis->flags = FIS_H2D_C;
+  if (queued)
+    {
+      /* Queued commands carry the count in the Features field and
+         the tag, which must be the slot number, in Count. */
+      cfis->featurel = cnt;
+      cfis->featureh = cnt >> 8;
+      cfis->countl = slot << 3;
+      cfis->counth = 0;
+    }
+  else if (fis->command != CMD_IDENTIFY_DEVICE)
+    {
+      cfis->countl = cnt;
+      cfis->counth = cnt >> 8;
+    }
+
+  header->flags = CH_CFL | (write ? CH_WRITE : 0);
+  header->prdtl = prd_cnt;
+  header->prdbc = 0;
+  barrier ();
+
+  /* Issue the command.  A queued command is also marked active. */
+  old_level = intr_disable ();
+  d->issued |= bit;
+  if (queued)
+    d->regs->sact = bit;
+  d->regs->ci = bit;
+  intr_set_level (old_level);
+
+  sema_down (&d->done[slot]);
+  free_slot (d, slot);
+}
+
+/* Moves the sectors starting at SEC_NO between disk D and the
+   IOV_CNT segments of IOV: into memory if WRITE is false, out of
+   it if WRITE is true.  Uses as few commands as the PRD tables
+   allow. */
+static void
+ahci_transfer (struct ahci_disk *d, block_sector_t sec_no,
+               const struct block_iov *iov, size_t iov_cnt, bool write)
+{
+  size_t total = 0;
+  size_t used = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    total += iov[i].cnt;
+
+  while (used < total)
+    {
+      block_sector_t sector = sec_no + used;
+      struct fis_h2d fis;
+
+      memset (&fis, 0, sizeof fis);
+      if (d->ncq)
+        fis.command = write ? CMD_WRITE_FPDMA_QUEUED : CMD_READ_FPDMA_QUEUED;
+      else
+        fis.command = write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT;
+      fis.device = DEV_LBA;
+      fis.lba0 = sector;
+      fis.lba1 = sector >> 8;
+      fis.lba2 = sector >> 16;
+      fis.lba3 = sector >> 24;
+      issue_command (d, &fis, iov, iov_cnt, &used, write);
+    }
+}
+
+/* Reads the sectors starting at SEC_NO from disk D into the
+   IOV_CNT segments of IOV, which must be in kernel memory. */
+static void
+ahci_readv (void *d, block_sector_t sec_no,
+            const struct block_iov *iov, size_t iov_cnt)
+{
+  ahci_transfer (d, sec_no, iov, iov_cnt, false);
+}
+
+/* Writes the sectors starting at SEC_NO to disk D from the
+   IOV_CNT segments of IOV, which must be in kernel memory.
+   Returns after the disk has acknowledged receiving the data. */
+static void
+ahci_writev (void *d, block_sector_t sec_no,
+             const struct block_iov *iov, size_t iov_cnt)
+{
+  ahci_transfer (d, sec_no, iov, iov_cnt, true);
+}
+
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ahci_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = buffer;
+  iov.cnt = 1;
+  ahci_transfer (d, sec_no, &iov, 1, false);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ahci_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = (void *) buffer;
+  iov.cnt = 1;
+  ahci_transfer (d, sec_no, &iov, 1, true);
+}
+
+static struct block_operations ahci_operations =
+  {
+    ahci_read,
+    ahci_write,
+    ahci_readv,
+    ahci_writev
+  };
+
+/* Wakes up the issuer of each command on disk D that has
+   completed.  A command is complete once the HBA has cleared its
+   bit in CI and, if queued, the disk has cleared it in SACT. */
+static void
+complete_commands (struct ahci_disk *d)
+{
+  volatile struct port_regs *p = d->regs;
+  uint32_t is = p->is;
+  uint32_t done;
+  int slot;
+
+  p->is = is;
+  if (is & PORT_IS_ERROR)
+    PANIC ("%s: command failed, status=%#"PRIx32" error=%#"PRIx32,
+           d->name, p->tfd & 0xff, (p->tfd >> 8) & 0xff);
+
+  done = d->issued & ~(p->sact | p->ci);
+  d->issued &= ~done;
+  for (slot = 0; done != 0; slot++, done >>= 1)
+    if (done & 1)
+      sema_up (&d->done[slot]);
+}
+
+/* Returns the disk on port PORT_NO of H, or a null pointer if
+   we do not drive one there. */
+static struct ahci_disk *
+find_disk (struct hba *h, int port_no)
+{
+  size_t n;
+
+  for (n = 0; n < disk_cnt; n++)
+    if (disks[n].hba == h && disks[n].port_no == port_no)
+      return &disks[n];
+  return NULL;
+}
+
+/* AHCI interrupt handler for HBA H_.  Handles every port with an
+   interrupt pending.  Since the line is level-triggered but the
+   PIC is not, keeps going until the HBA has nothing pending, so
+   that no event goes unnoticed. */
+static void
+interrupt_handler (void *h_)
+{
+  struct hba *h = h_;
+  uint32_t is;
+  int port_no;
+
+  while ((is = h->regs->is) != 0)
+    {
+      for (port_no = 0; port_no < 32; port_no++)
+        if (is & (1u << port_no))
+          {
+            struct ahci_disk *d = find_disk (h, port_no);
+            if (d != NULL)
+              complete_commands (d);
+            else
+              h->regs->ports[port_no].is = h->regs->ports[port_no].is;
+          }
+      h->regs->is = is;
+    }
+}
@@ -1,9 +1,15 @@
 #include "devices/block.h"
 #include <list.h>
+#include <round.h>
 #include <string.h>
 #include <stdio.h>
+#include <ustar.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 /* A block device. */
 struct block
@@ -11,23 +17,56 @@ struct block
     struct list_elem list_elem;         /* Element in all_blocks. */
 
     char name[16];                      /* Block device name. */
+    int dev_no;                         /* Registration order, from 0. */
     enum block_type type;                /* Type of block device. */
     block_sector_t size;                 /* Size in sectors. */
 
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
+    struct block *parent;               /* For a partition, its device. */
+    block_sector_t start;               /* For a partition, its first
+                                           sector within PARENT. */
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long transfer_cnt;    /* Driver transfers. */
+    int64_t io_ticks;                   /* Ticks requests spent queued
+                                           or in I/O. */
+    unsigned long long latency[BLOCK_LATENCY_BUCKETS]; /* Histogram. */
+
+    /* Request queue.  See block_submit(). */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_nonempty;    /* Signaled on submission. */
+    struct list queue;                  /* Requests in sector order. */
+    struct list fifo;                   /* Requests in submission order. */
+    block_sector_t head;                /* Sector after last dispatched. */
+    int queue_depth;                    /* Most transfers in flight. */
+    int dispatcher_cnt;                 /* Dispatcher threads created. */
   };
 
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
+/* Number of block devices registered. */
+static int block_cnt;
+
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* Trace ring buffer.  See block_trace().  Updated with interrupts
+   off, so that any thread may add to it without a lock. */
+static struct block_trace_record *trace_ring;
+static size_t trace_size;               /* Records in trace_ring. */
+static size_t trace_cnt;                /* Records used. */
+static size_t trace_next;               /* Where the next record goes. */
+static uint32_t trace_lost;             /* Records overwritten. */
+
 static struct block *list_elem_to_block (struct list_elem *);
+static void account_latency (struct block *, int64_t start);
+static void check_request (struct block *, struct block_request *);
+static void do_request (struct block *, bool write, block_sector_t,
+                        const struct block_iov *, size_t iov_cnt);
+static thread_func dispatcher;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -120,9 +159,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_range (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +170,371 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_range (block, sector, 1, buffer);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that support it move the whole range with as
+   few device commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_range (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = buffer;
+  iov.cnt = cnt;
+  block_readv (block, sector, &iov, 1);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  Drivers that support it move the whole range
+   with as few device commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_range (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = (void *) buffer;
+  iov.cnt = cnt;
+  block_writev (block, sector, &iov, 1);
+}
+
+/* Reads consecutive sectors starting at SECTOR from BLOCK into
+   the IOV_CNT segments of IOV, in order.  Drivers that support
+   it move all of them with as few device commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_readv (struct block *block, block_sector_t sector,
+             const struct block_iov *iov, size_t iov_cnt)
+{
+  do_request (block, false, sector, iov, iov_cnt);
+}
+
+/* Writes consecutive sectors starting at SECTOR to BLOCK from
+   the IOV_CNT segments of IOV, in order.  Returns after the block
+   device has acknowledged receiving all of the data.  Drivers
+   that support it move all of them with as few device commands
+   as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_writev (struct block *block, block_sector_t sector,
+              const struct block_iov *iov, size_t iov_cnt)
+{
+  do_request (block, true, sector, iov, iov_cnt);
+}
+
+/* Request completion function for do_request(). */
+static void
+wake_submitter (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Submits a request to move the sectors starting at SECTOR
+   between BLOCK and the IOV_CNT segments of IOV, and waits for
+   it to complete.  Does nothing if there are no sectors. */
+static void
+do_request (struct block *block, bool write, block_sector_t sector,
+            const struct block_iov *iov, size_t iov_cnt)
+{
+  struct block_request r;
+  struct semaphore done;
+  size_t i;
+
+  r.cnt = 0;
+  for (i = 0; i < iov_cnt; i++)
+    r.cnt += iov[i].cnt;
+  if (r.cnt == 0)
+    return;
+
+  sema_init (&done, 0);
+  r.write = write;
+  r.sector = sector;
+  r.buffer = NULL;
+  r.iov = iov;
+  r.iov_cnt = iov_cnt;
+  r.complete = wake_submitter;
+  r.aux = &done;
+  block_submit (block, &r);
+  sema_down (&done);
+}
+
+/* Panics if R is not a valid request for BLOCK. */
+static void
+check_request (struct block *block, struct block_request *r)
+{
+  ASSERT (r->cnt > 0);
+  ASSERT (r->iov != NULL || r->buffer != NULL);
+  ASSERT (r->complete != NULL);
+  check_sector (block, r->sector);
+  check_sector (block, r->sector + r->cnt - 1);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+}
+
+/* Orders requests by sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+  return a->sector < b->sector;
+}
+
+/* Queues request R for BLOCK and returns without waiting for it.
+   R->complete is called, from BLOCK's dispatcher thread, once
+   the request is done; until then R, its IOV if any, and its
+   buffers belong to the block layer.  Panics if R is out of
+   BLOCK's range.
+
+   A partition has no queue of its own.  Its requests go straight
+   onto its device's queue, translated to the device's sectors,
+   so that they are sorted and merged along with the device's
+   other requests and served by the device's dispatchers. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  if (r->iov == NULL)
+    {
+      r->seg.buffer = r->buffer;
+      r->seg.cnt = r->cnt;
+      r->iov = &r->seg;
+      r->iov_cnt = 1;
+    }
+  check_request (block, r);
+  r->submitted = timer_ticks ();
+  r->dev = block;
+  block_trace (block, r->sector, r->cnt, r->write ? BLOCK_TRACE_WRITE : 0);
+  while (block->parent != NULL)
+    {
+      r->sector += block->start;
+      block = block->parent;
+      block_trace (block, r->sector, r->cnt,
+                   r->write ? BLOCK_TRACE_WRITE : 0);
+    }
+
+  lock_acquire (&block->queue_lock);
+  while (block->dispatcher_cnt < block->queue_depth)
+    {
+      char name[sizeof block->name + 3];
+      snprintf (name, sizeof name, "%s-io", block->name);
+      if (thread_create (name, PRI_DEFAULT, dispatcher, block) == TID_ERROR)
+        PANIC ("%s: can't start request dispatcher", block->name);
+      block->dispatcher_cnt++;
+    }
+  list_insert_ordered (&block->queue, &r->elem, request_less, NULL);
+  list_push_back (&block->fifo, &r->fifo_elem);
+  cond_signal (&block->queue_nonempty, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Returns true if request R has waited past its deadline. */
+static bool
+request_expired (const struct block_request *r)
+{
+  return timer_elapsed (r->submitted) >= (r->write
+                                          ? BLOCK_WRITE_DEADLINE
+                                          : BLOCK_READ_DEADLINE);
+}
+
+/* Chooses the next request to dispatch from BLOCK's nonempty
+   queue: the oldest request if it has expired, otherwise the
+   first one at or after BLOCK->head, wrapping around to the
+   lowest sector.  Must be called with BLOCK's queue_lock held. */
+static struct block_request *
+choose_request (struct block *block)
+{
+  struct block_request *oldest;
+  struct list_elem *e;
+
+  oldest = list_entry (list_front (&block->fifo), struct block_request,
+                       fifo_elem);
+  if (request_expired (oldest))
+    return oldest;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head)
+        return r;
+    }
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+/* Removes FIRST, and the queued requests that continue it in the
+   same direction, from BLOCK's queue, up to BLOCK_MERGE_MAX
+   sectors and segments in all, and stores them in BATCH.
+   Returns the number of requests stored.  Must be called with
+   BLOCK's queue_lock held. */
+static size_t
+take_batch (struct block *block, struct block_request *first,
+            struct block_request *batch[BLOCK_MERGE_MAX])
+{
+  size_t req_cnt = 0;
+  size_t sec_cnt = first->cnt;
+  size_t seg_cnt = first->iov_cnt;
+  struct list_elem *e = list_next (&first->elem);
+
+  batch[req_cnt++] = first;
+  while (e != list_end (&block->queue) && req_cnt < BLOCK_MERGE_MAX)
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->write != first->write
+          || r->sector != first->sector + sec_cnt
+          || sec_cnt + r->cnt > BLOCK_MERGE_MAX
+          || seg_cnt + r->iov_cnt > BLOCK_MERGE_MAX)
+        break;
+      batch[req_cnt++] = r;
+      sec_cnt += r->cnt;
+      seg_cnt += r->iov_cnt;
+      e = list_next (e);
+    }
+
+  for (size_t i = 0; i < req_cnt; i++)
+    {
+      list_remove (&batch[i]->elem);
+      list_remove (&batch[i]->fifo_elem);
+    }
+  return req_cnt;
+}
+
+/* Has BLOCK's driver move the consecutive sectors starting at
+   SECTOR between the device and the IOV_CNT segments of IOV. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          const struct block_iov *iov, size_t iov_cnt)
+{
+  size_t i, j;
+
+  if (write && block->ops->writev != NULL)
+    block->ops->writev (block->aux, sector, iov, iov_cnt);
+  else if (!write && block->ops->readv != NULL)
+    block->ops->readv (block->aux, sector, iov, iov_cnt);
+  else
+    for (i = 0; i < iov_cnt; i++)
+      for (j = 0; j < iov[i].cnt; j++)
+        {
+          uint8_t *buffer = (uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE;
+          if (write)
+            block->ops->write (block->aux, sector++, buffer);
+          else
+            block->ops->read (block->aux, sector++, buffer);
+        }
+}
+
+/* Carries out the REQ_CNT requests in BATCH, which cover
+   consecutive sectors in one direction, as a single transfer,
+   gathering their segments into one scatter-gather list.
+   Segments that are adjacent in memory are coalesced. */
+static void
+run_batch (struct block *block, struct block_request *batch[],
+           size_t req_cnt)
+{
+  struct block_iov iov[BLOCK_MERGE_MAX];
+  size_t iov_cnt = 0;
+  size_t i, j;
+
+  if (req_cnt == 1)
+    {
+      transfer (block, batch[0]->write, batch[0]->sector,
+                batch[0]->iov, batch[0]->iov_cnt);
+      return;
+    }
+
+  for (i = 0; i < req_cnt; i++)
+    for (j = 0; j < batch[i]->iov_cnt; j++)
+      {
+        const struct block_iov *seg = &batch[i]->iov[j];
+        struct block_iov *prev = iov_cnt > 0 ? &iov[iov_cnt - 1] : NULL;
+        if (prev != NULL
+            && seg->buffer == (uint8_t *) prev->buffer + prev->cnt * BLOCK_SECTOR_SIZE)
+          prev->cnt += seg->cnt;
+        else
+          iov[iov_cnt++] = *seg;
+      }
+  transfer (block, batch[0]->write, batch[0]->sector, iov, iov_cnt);
+}
+
+/* Adds request R, just carried out by BLOCK, to the statistics
+   of BLOCK and, if R was submitted to a partition of BLOCK, of
+   that partition.  Must be called with BLOCK's queue_lock
+   held. */
+static void
+account_request (struct block *block, struct block_request *r)
+{
+  struct block *b;
+
+  for (b = r->dev; ; b = b->parent)
+    {
+      if (r->write)
+        b->write_cnt += r->cnt;
+      else
+        b->read_cnt += r->cnt;
+      account_latency (b, r->submitted);
+      if (b == block)
+        break;
+    }
+}
+
+/* Request dispatcher thread for the block device AUX.  Takes
+   batches of requests off the device's queue, carries them out
+   and completes them, one batch at a time.  A device with a
+   queue depth above 1 has that many dispatchers, each with one
+   batch in flight. */
+static void
+dispatcher (void *block_)
+{
+  struct block *block = block_;
+  struct block_request *batch[BLOCK_MERGE_MAX];
+
+  for (;;)
+    {
+      struct block_request *first;
+      size_t req_cnt, i;
+
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->queue_lock);
+      first = choose_request (block);
+      req_cnt = take_batch (block, first, batch);
+      block->head = batch[req_cnt - 1]->sector + batch[req_cnt - 1]->cnt;
+      lock_release (&block->queue_lock);
+
+      run_batch (block, batch, req_cnt);
+
+      lock_acquire (&block->queue_lock);
+      block->transfer_cnt++;
+      for (i = 0; i < req_cnt; i++)
+        {
+          struct block_request *r = batch[i];
+          if (r->dev != block && (i == 0 || batch[i - 1]->dev != r->dev))
+            r->dev->transfer_cnt++;
+          account_request (block, r);
+        }
+      lock_release (&block->queue_lock);
+
+      for (i = 0; i < req_cnt; i++)
+        {
+          struct block_request *r = batch[i];
+          struct block *b;
+
+          for (b = r->dev; b != block; b = b->parent)
+            r->sector -= b->start;
+          r->complete (r);
+        }
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -153,6 +551,14 @@ block_name (struct block *block)
   return block->name;
 }
 
+/* Returns the device that BLOCK is a partition of, or a null
+   pointer if BLOCK is not a partition. */
+struct block *
+block_parent (struct block *block)
+{
+  return block->parent;
+}
+
 /* Returns BLOCK's type. */
 enum block_type
 block_type (struct block *block)
@@ -160,24 +566,253 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Adds a request to BLOCK that started at timer tick START to
+   BLOCK's latency statistics. */
+static void
+account_latency (struct block *block, int64_t start)
+{
+  int64_t elapsed = timer_elapsed (start);
+  int bucket = 0;
+
+  block->io_ticks += elapsed;
+  while (elapsed > 0 && bucket < BLOCK_LATENCY_BUCKETS - 1)
+    {
+      elapsed >>= 1;
+      bucket++;
+    }
+  block->latency[bucket]++;
+}
+
+/* Lets up to DEPTH transfers to BLOCK be in flight at once, for
+   drivers that can overlap them.  The driver's operations are
+   then called from up to DEPTH threads at a time.  Must be called
+   before the first request is submitted to BLOCK.  A partition
+   uses its device's dispatchers, so it has no depth of its own. */
+void
+block_set_queue_depth (struct block *block, int depth)
+{
+  ASSERT (depth >= 1);
+  ASSERT (block->parent == NULL);
+  ASSERT (block->dispatcher_cnt == 0);
+  block->queue_depth = depth;
+}
+
+/* Returns the number of transfers to BLOCK that may be in flight
+   at once.  For a partition, that is its device's queue depth. */
+int
+block_queue_depth (struct block *block)
+{
+  while (block->parent != NULL)
+    block = block->parent;
+  return block->queue_depth;
+}
+
+/* Copies BLOCK's I/O statistics into STATS. */
+void
+block_get_stats (struct block *block, struct block_stats *stats)
+{
+  int i;
+
+  stats->read_cnt = block->read_cnt;
+  stats->write_cnt = block->write_cnt;
+  stats->transfer_cnt = block->transfer_cnt;
+  stats->io_ticks = block->io_ticks;
+  for (i = 0; i < BLOCK_LATENCY_BUCKETS; i++)
+    stats->latency[i] = block->latency[i];
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
 {
-  int i;
+  int i, j;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
     {
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads, %llu writes, %llu transfers, "
+                  "%lld ticks in I/O\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt, block->transfer_cnt,
+                  block->io_ticks);
+          printf ("%s latency (ticks):", block->name);
+          for (j = 0; j < BLOCK_LATENCY_BUCKETS; j++)
+            {
+              int lo = j == 0 ? 0 : 1 << (j - 1);
+              int hi = (1 << j) - 1;
+              if (j == BLOCK_LATENCY_BUCKETS - 1)
+                printf (" %d+:%llu", lo, block->latency[j]);
+              else if (lo == hi)
+                printf (" %d:%llu", lo, block->latency[j]);
+              else
+                printf (" %d-%d:%llu", lo, hi, block->latency[j]);
+            }
+          printf ("\n");
         }
     }
 }
 
+/* Starts recording a trace of block I/O, keeping the most recent
+   RECORD_CNT events.  Does nothing if RECORD_CNT is 0. */
+void
+block_trace_init (size_t record_cnt)
+{
+  if (record_cnt == 0)
+    return;
+  trace_ring = malloc (record_cnt * sizeof *trace_ring);
+  if (trace_ring == NULL)
+    PANIC ("Failed to allocate memory for %zu trace records", record_cnt);
+  trace_size = record_cnt;
+}
+
+/* Returns true if block I/O is being traced. */
+bool
+block_trace_enabled (void)
+{
+  return trace_ring != NULL;
+}
+
+/* Adds a record of an event involving the CNT sectors starting at
+   SECTOR of BLOCK, with the given BLOCK_TRACE_* FLAGS, on behalf
+   of the running thread, to the trace.  Does nothing if tracing
+   is not enabled.  May be called from any thread. */
+void
+block_trace (struct block *block, block_sector_t sector, size_t cnt,
+             unsigned flags)
+{
+  struct block_trace_record *rec;
+  enum intr_level old_level;
+
+  if (trace_ring == NULL)
+    return;
+
+  old_level = intr_disable ();
+  rec = &trace_ring[trace_next];
+  rec->ticks = timer_ticks ();
+  rec->sector = sector;
+  rec->cnt = cnt;
+  rec->tid = thread_current ()->tid;
+  rec->dev_no = block->dev_no;
+  rec->flags = flags;
+  rec->reserved = 0;
+  trace_next = (trace_next + 1) % trace_size;
+  if (trace_cnt < trace_size)
+    trace_cnt++;
+  else
+    trace_lost++;
+  intr_set_level (old_level);
+}
+
+/* Copies SIZE bytes from SRC into the file being written to DST
+   starting at *SECTOR, through the sector-sized BUFFER, of which
+   *OFS bytes are already filled.  Writes out BUFFER and advances
+   *SECTOR each time it fills up. */
+static void
+trace_output (struct block *dst, block_sector_t *sector,
+              uint8_t *buffer, size_t *ofs, const void *src, size_t size)
+{
+  const uint8_t *p = src;
+
+  while (size > 0)
+    {
+      size_t chunk = BLOCK_SECTOR_SIZE - *ofs;
+      if (chunk > size)
+        chunk = size;
+      memcpy (buffer + *ofs, p, chunk);
+      *ofs += chunk;
+      p += chunk;
+      size -= chunk;
+      if (*ofs == BLOCK_SECTOR_SIZE)
+        {
+          if (*sector >= block_size (dst))
+            PANIC ("%s: out of space for block trace", dst->name);
+          block_write (dst, (*sector)++, buffer);
+          *ofs = 0;
+        }
+    }
+}
+
+/* Stops tracing and writes the trace to DST as a ustar archive
+   member named "blktrace", starting at SECTOR, followed by an
+   end-of-archive marker.  Returns the number of sectors written,
+   not counting the end-of-archive marker, so that another file may
+   be appended after it.  Does nothing and returns 0 if tracing is
+   not enabled. */
+block_sector_t
+block_trace_dump (struct block *dst, block_sector_t sector)
+{
+  struct block_trace_header *h;
+  struct block_trace_record *ring;
+  block_sector_t start = sector;
+  struct list_elem *e;
+  uint8_t *buffer;
+  size_t ofs = 0;
+  enum intr_level old_level;
+
+  if (trace_ring == NULL)
+    return 0;
+
+  /* Stop tracing, so that the dump itself is not traced. */
+  old_level = intr_disable ();
+  ring = trace_ring;
+  trace_ring = NULL;
+  intr_set_level (old_level);
+
+  h = calloc (1, sizeof *h);
+  buffer = malloc (2 * BLOCK_SECTOR_SIZE);
+  if (h == NULL || buffer == NULL)
+    PANIC ("Failed to allocate memory for block trace dump");
+  memcpy (h->magic, BLOCK_TRACE_MAGIC, sizeof h->magic);
+  h->record_cnt = trace_cnt;
+  h->lost_cnt = trace_lost;
+  h->ticks_per_sec = TIMER_FREQ;
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      if (block->dev_no < BLOCK_TRACE_DEVICES)
+        {
+          strlcpy (h->devices[block->dev_no], block->name,
+                   sizeof h->devices[block->dev_no]);
+          if (block->dev_no >= (int) h->device_cnt)
+            h->device_cnt = block->dev_no + 1;
+        }
+    }
+
+  /* Header, then the ring from its oldest record on. */
+  if (!ustar_make_header ("blktrace", USTAR_REGULAR,
+                          sizeof *h + trace_cnt * sizeof *ring,
+                          (char *) buffer))
+    NOT_REACHED ();
+  block_write (dst, sector++, buffer);
+  trace_output (dst, &sector, buffer, &ofs, h, sizeof *h);
+  if (trace_cnt == trace_size)
+    trace_output (dst, &sector, buffer, &ofs, ring + trace_next,
+                  (trace_size - trace_next) * sizeof *ring);
+  trace_output (dst, &sector, buffer, &ofs, ring, trace_next * sizeof *ring);
+  if (ofs > 0)
+    {
+      memset (buffer + ofs, 0, BLOCK_SECTOR_SIZE - ofs);
+      if (sector >= block_size (dst))
+        PANIC ("%s: out of space for block trace", dst->name);
+      block_write (dst, sector++, buffer);
+    }
+
+  /* End-of-archive marker. */
+  if (sector + 2 > block_size (dst))
+    PANIC ("%s: out of space for block trace", dst->name);
+  memset (buffer, 0, 2 * BLOCK_SECTOR_SIZE);
+  block_write_range (dst, sector, 2, buffer);
+
+  printf ("%s: wrote block trace, %zu records\n", dst->name, trace_cnt);
+  free (buffer);
+  free (h);
+  free (ring);
+  return sector - start;
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -194,12 +829,25 @@ block_register (const char *name, enum block_type type,
 
   list_push_back (&all_blocks, &block->list_elem);
   strlcpy (block->name, name, sizeof block->name);
+  block->dev_no = block_cnt++;
   block->type = type;
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  block->parent = NULL;
+  block->start = 0;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->transfer_cnt = 0;
+  block->io_ticks = 0;
+  memset (block->latency, 0, sizeof block->latency);
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_nonempty);
+  list_init (&block->queue);
+  list_init (&block->fifo);
+  block->head = 0;
+  block->queue_depth = 1;
+  block->dispatcher_cnt = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -211,6 +859,23 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Registers a partition of PARENT named NAME, of the given TYPE,
+   that covers the SIZE sectors starting at START.  EXTRA_INFO is
+   as for block_register().  Requests to the partition are served
+   by PARENT's queue (see block_submit()), so it needs no
+   operations of its own. */
+struct block *
+block_register_partition (const char *name, enum block_type type,
+                          const char *extra_info, struct block *parent,
+                          block_sector_t start, block_sector_t size)
+{
+  struct block *block = block_register (name, type, extra_info, size,
+                                        NULL, NULL);
+  block->parent = parent;
+  block->start = start;
+  return block;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,22 +54,168 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_range (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_range (struct block *, block_sector_t, size_t cnt,
+                        const void *);
+
+/* A segment of a scatter-gather list: CNT sectors' worth of
+   contiguous memory at BUFFER. */
+struct block_iov
+  {
+    void *buffer;
+    size_t cnt;
+  };
+
+void block_readv (struct block *, block_sector_t,
+                  const struct block_iov *, size_t iov_cnt);
+void block_writev (struct block *, block_sector_t,
+                   const struct block_iov *, size_t iov_cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
+struct block *block_parent (struct block *);
+
+/* Asynchronous requests.
+
+   block_submit() queues a request and returns at once.  Each
+   device has a dispatcher thread that serves its queue in C-LOOK
+   order, ascending by sector and wrapping around, except that a
+   request waiting longer than its deadline is served first.
+   Queued requests for adjacent sectors in the same direction are
+   merged into a single driver transfer.  A partition shares its
+   device's queue and dispatchers.  When a request is done, the
+   dispatcher calls its COMPLETE function.  The synchronous
+   calls above are requests whose submitter waits for
+   completion. */
+
+/* Deadlines, in timer ticks after submission. */
+#define BLOCK_READ_DEADLINE 25
+#define BLOCK_WRITE_DEADLINE 100
+
+/* Most sectors, and most segments, merged into one driver
+   transfer. */
+#define BLOCK_MERGE_MAX 32
+
+/* A block request. */
+struct block_request
+  {
+    /* Set by the submitter. */
+    bool write;                         /* Write, or read? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors, at least 1. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    const struct block_iov *iov;        /* If nonnull, used instead of
+                                           BUFFER and CNT. */
+    size_t iov_cnt;                     /* Number of segments in IOV. */
+    void (*complete) (struct block_request *); /* Called when done. */
+    void *aux;                          /* For COMPLETE's use. */
+
+    /* Owned by the block layer while queued. */
+    struct list_elem elem;              /* Element in sector-ordered queue. */
+    struct list_elem fifo_elem;         /* Element in submission-order queue. */
+    struct block *dev;                  /* Device submitted to. */
+    int64_t submitted;                  /* timer_ticks() at submission. */
+    struct block_iov seg;               /* IOV for a BUFFER request. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+void block_set_queue_depth (struct block *, int depth);
+int block_queue_depth (struct block *);
 
 /* Statistics. */
+
+/* Number of latency histogram buckets.  Latency runs from
+   submission to completion.  Bucket 0 counts requests that
+   completed in the timer tick they were submitted in, bucket I > 0
+   those that took 2**(I-1) to 2**I - 1 ticks.  The last bucket
+   also counts anything slower. */
+#define BLOCK_LATENCY_BUCKETS 8
+
+/* I/O statistics for a block device. */
+struct block_stats
+  {
+    unsigned long long read_cnt;        /* Number of sectors read. */
+    unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long transfer_cnt;    /* Driver transfers after merging. */
+    int64_t io_ticks;                   /* Ticks requests spent queued
+                                           or in I/O. */
+    unsigned long long latency[BLOCK_LATENCY_BUCKETS]; /* Histogram. */
+  };
+
+void block_get_stats (struct block *, struct block_stats *);
 void block_print_stats (void);
+
+/* Tracing.
+
+   When enabled, the block layer records each request submitted
+   to any block device, and the buffer cache records each lookup,
+   in a ring buffer that keeps the most recent events.
+   block_trace_dump() writes the ring out in the format below,
+   which utils/blktrace-sim reads. */
+
+/* Trace record flags. */
+#define BLOCK_TRACE_WRITE 0x01          /* Write, not read. */
+#define BLOCK_TRACE_CACHE 0x02          /* Buffer cache lookup, not a
+                                           device request. */
+#define BLOCK_TRACE_HIT 0x04            /* Cache lookup found the sector. */
+#define BLOCK_TRACE_META 0x08           /* Cache lookup was for metadata. */
+#define BLOCK_TRACE_PREFETCH 0x10       /* Cache lookup was a read-ahead. */
+
+/* A trace record. */
+struct block_trace_record
+  {
+    int64_t ticks;                      /* timer_ticks() at event. */
+    block_sector_t sector;              /* First sector. */
+    uint32_t cnt;                       /* Number of sectors. */
+    int32_t tid;                        /* Requesting thread. */
+    uint8_t dev_no;                     /* Device, in registration order. */
+    uint8_t flags;                      /* BLOCK_TRACE_*. */
+    uint16_t reserved;
+  };
+
+/* Most devices whose names a trace file records. */
+#define BLOCK_TRACE_DEVICES 32
+
+/* Header at the start of a trace file, followed by RECORD_CNT
+   records, oldest first.  All fields are little-endian. */
+#define BLOCK_TRACE_MAGIC "PINTRACE"
+struct block_trace_header
+  {
+    char magic[8];                      /* BLOCK_TRACE_MAGIC. */
+    uint32_t record_cnt;                /* Number of records that follow. */
+    uint32_t lost_cnt;                  /* Older records overwritten. */
+    uint32_t ticks_per_sec;             /* TIMER_FREQ. */
+    uint32_t device_cnt;                /* Entries used in DEVICES. */
+    char devices[BLOCK_TRACE_DEVICES][16]; /* Names by device number. */
+  };
+
+void block_trace_init (size_t record_cnt);
+bool block_trace_enabled (void);
+void block_trace (struct block *, block_sector_t, size_t cnt, unsigned flags);
+block_sector_t block_trace_dump (struct block *, block_sector_t);
 
 /* Lower-level interface to block device drivers. */
 
+/* READV and WRITEV transfer the consecutive sectors described
+   by a scatter-gather list at once.  They are optional: the block
+   layer falls back to READ and WRITE, one sector at a time, for
+   drivers that leave them null. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*readv) (void *aux, block_sector_t,
+                   const struct block_iov *, size_t iov_cnt);
+    void (*writev) (void *aux, block_sector_t,
+                    const struct block_iov *, size_t iov_cnt);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+struct block *block_register_partition (const char *name, enum block_type,
+                                        const char *extra_info,
+                                        struct block *parent,
+                                        block_sector_t start,
+                                        block_sector_t size);
 
 #endif /* devices/block.h */
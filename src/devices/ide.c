@@ -3,19 +3,34 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the channels
+   belong to a PCI IDE controller with bus-master DMA, such as the
+   PIIX emulated by QEMU and Bochs, data is moved by DMA [SFF-8038i];
+   otherwise, by programmed I/O.
+
+   Requests reach the driver from each disk's block-layer dispatcher
+   thread (see block_submit()), so the two channels have transfers
+   in flight independently of each other and of the threads that
+   submitted them.  The two disks on one channel take turns under
+   the channel's lock, because a channel runs one command at a
+   time. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
 #define reg_error(CHANNEL) ((CHANNEL)->reg_base + 1)    /* Error. */
+#define reg_features(CHANNEL) reg_error (CHANNEL)       /* Features (w/o). */
 #define reg_nsect(CHANNEL) ((CHANNEL)->reg_base + 2)    /* Sector Count. */
 #define reg_lbal(CHANNEL) ((CHANNEL)->reg_base + 3)     /* LBA 0:7. */
 #define reg_lbam(CHANNEL) ((CHANNEL)->reg_base + 4)     /* LBA 15:8. */
@@ -30,10 +45,25 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master port addresses, for channels with DMA. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prd(CHANNEL) ((CHANNEL)->bm_base + 4)     /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer to memory (disk read). */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error; write 1 to clear. */
+#define BM_STA_IRQ 0x04         /* Interrupt; write 1 to clear. */
+#define BM_STA_DMA0 0x20        /* Device 0 is DMA capable. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +79,19 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+#define CMD_SET_FEATURES 0xef           /* SET FEATURES. */
+
+/* SET FEATURES subcommands. */
+#define FEAT_XFER_MODE 0x03             /* Set transfer mode. */
+
+/* Most sectors moved by one READ or WRITE command.  A sector count
+   of 0 in the Sector Count register means 256. */
+#define MAX_SECTORS_PER_COMMAND 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,7 +100,20 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    size_t multiple;            /* Sectors per DRQ block; 1 if the disk
+                                   does not do READ/WRITE MULTIPLE. */
+    bool dma;                   /* Transfer data by DMA? */
+  };
+
+/* A bus master DMA physical region descriptor. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address of region. */
+    uint16_t size;              /* Size in bytes; 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT or 0. */
   };
+#define PRD_EOT 0x8000          /* Last entry in table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
 
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
@@ -72,6 +128,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if no DMA. */
+    struct prd *prd;            /* PRD table, if bm_base is nonzero. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -84,8 +143,11 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, const uint16_t *id);
+static uint16_t find_bus_master (void);
+static void set_dma_mode (struct ata_disk *, const uint16_t *id);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -101,6 +163,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +189,14 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prd = NULL;
+      if (bm_base != 0)
+        {
+          c->prd = palloc_get_page (0);
+          if (c->prd != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +207,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 1;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -303,6 +376,11 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  set_multiple_mode (d, (const uint16_t *) id);
+  set_dma_mode (d, (const uint16_t *) id);
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -337,23 +415,335 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D, whose IDENTIFY DEVICE
+   response is ID, with the largest power-of-2 DRQ block size the
+   disk supports.  Leaves D->multiple at 1 if the disk does not
+   support multiple mode or refuses the setting. */
+static void
+set_multiple_mode (struct ata_disk *d, const uint16_t *id)
+{
+  struct channel *c = d->channel;
+  size_t max = id[47] & 0xff;
+  size_t multiple = 1;
+
+  while (multiple * 2 <= max)
+    multiple *= 2;
+  if (multiple < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = multiple;
+}
+
+/* Returns the bus master base port of the PCI IDE controller
+   that drives the legacy channels, with bus mastering enabled, or
+   0 if there is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_addr a;
+  uint8_t prog_if;
+
+  if (!pci_find_class (0x01, 0x01, 0, &a))
+    return 0;
+
+  /* Both channels must be in compatibility mode, at the legacy
+     ports, and the controller must be bus master capable. */
+  prog_if = pci_read8 (a, PCI_REG_PROG_IF);
+  if ((prog_if & 0x85) != 0x80 || !(pci_read32 (a, PCI_REG_BAR0 + 4 * 4) & 1))
+    return 0;
+
+  pci_write16 (a, PCI_REG_COMMAND,
+               pci_read16 (a, PCI_REG_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+  return pci_bar (a, 4);
+}
+
+/* Puts disk D, whose IDENTIFY DEVICE response is ID, in its
+   fastest multiword or Ultra DMA mode and sets D->dma if D's
+   channel has a bus master and the disk accepts the mode. */
+static void
+set_dma_mode (struct ata_disk *d, const uint16_t *id)
+{
+  struct channel *c = d->channel;
+  uint8_t mode;
+  int i;
+
+  if (c->bm_base == 0 || !(id[49] & 0x100))
+    return;
+
+  /* Word 88 lists the Ultra DMA modes, if word 53 says it is
+     valid; word 63 lists the multiword DMA modes. */
+  mode = 0;
+  if ((id[53] & 0x04) && (id[88] & 0x7f))
+    {
+      for (i = 6; !(id[88] & (1 << i)); i--)
+        continue;
+      mode = 0x40 | i;
+    }
+  else if (id[63] & 0x07)
+    {
+      for (i = 2; !(id[63] & (1 << i)); i--)
+        continue;
+      mode = 0x20 | i;
+    }
+  else
+    return;
+
+  select_device_wait (d);
+  outb (reg_features (c), FEAT_XFER_MODE);
+  outb (reg_nsect (c), mode);
+  issue_pio_command (c, CMD_SET_FEATURES);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (inb (reg_status (c)) & STA_ERR)
+    return;
+
+  d->dma = true;
+  outb (reg_bm_status (c), ((inb (reg_bm_status (c)) & ~(BM_STA_ERR | BM_STA_IRQ))
+                            | (BM_STA_DMA0 << d->dev_no)));
+}
+
+/* A position within a scatter-gather list. */
+struct iov_pos
+  {
+    const struct block_iov *iov;        /* Current segment. */
+    size_t ofs;                         /* Sectors into it. */
+  };
+
+/* Returns the buffer for the sector at POS and advances POS to
+   the next sector. */
+static uint8_t *
+next_sector (struct iov_pos *pos)
+{
+  uint8_t *sector;
+
+  while (pos->ofs >= pos->iov->cnt)
+    {
+      pos->iov++;
+      pos->ofs = 0;
+    }
+  sector = (uint8_t *) pos->iov->buffer + pos->ofs++ * BLOCK_SECTOR_SIZE;
+  return sector;
+}
+
+/* Adds the SIZE bytes at BUFFER to channel C's PRD table, whose
+   first *PRD_CNT entries are in use, extending the last entry
+   where possible.  No region crosses a 64 kB boundary.  Returns
+   false if the buffer cannot be transferred by DMA: it must be in
+   kernel memory, which is physically contiguous, and 2-byte
+   aligned, and must fit in the table. */
+static bool
+add_prd (struct channel *c, size_t *prd_cnt, const void *buffer, size_t size)
+{
+  const uint8_t *p = buffer;
+
+  if (!is_kernel_vaddr (p) || ((uintptr_t) p & 1) != 0)
+    return false;
+
+  while (size > 0)
+    {
+      uint32_t addr = vtop (p);
+      size_t chunk = 0x10000 - (addr & 0xffff);
+      struct prd *last = *prd_cnt > 0 ? &c->prd[*prd_cnt - 1] : NULL;
+
+      if (chunk > size)
+        chunk = size;
+      if (last != NULL && last->size != 0
+          && last->addr + last->size == addr
+          && (last->addr >> 16) == ((addr + chunk - 1) >> 16))
+        last->size = (last->size + chunk) & 0xffff;
+      else if (*prd_cnt < PRD_CNT)
+        {
+          last = &c->prd[(*prd_cnt)++];
+          last->addr = addr;
+          last->size = chunk & 0xffff;
+          last->flags = 0;
+        }
+      else
+        return false;
+
+      p += chunk;
+      size -= chunk;
+    }
+  return true;
+}
+
+/* Moves CNT sectors, between 1 and MAX_SECTORS_PER_COMMAND,
+   starting at SEC_NO between disk D and the scatter-gather list
+   at *POS by DMA: into memory if WRITE is false, out of it if
+   WRITE is true, and advances *POS past them.  Returns false
+   without doing anything if D does not use DMA or a buffer is
+   unsuitable, so that the caller can fall back to PIO.  D's
+   channel must be locked. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct iov_pos *pos, bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  struct iov_pos p = *pos;
+  size_t prd_cnt = 0;
+  uint8_t bm_status;
+  size_t i;
+
+  if (!d->dma)
+    return false;
+  for (i = 0; i < cnt; i++)
+    if (!add_prd (c, &prd_cnt, next_sector (&p), BLOCK_SECTOR_SIZE))
+      return false;
+  c->prd[prd_cnt - 1].flags = PRD_EOT;
+  *pos = p;
+
+  outl (reg_bm_prd (c), vtop (c->prd));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_IRQ);
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+  outb (reg_bm_command (c), direction);
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_IRQ);
+  if ((bm_status & BM_STA_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+  return true;
+}
+
+/* Reads CNT sectors, between 1 and MAX_SECTORS_PER_COMMAND,
+   starting at SEC_NO from disk D into the scatter-gather list at
+   *POS by PIO, with one interrupt per DRQ block of D->multiple
+   sectors, and advances *POS past them.  D's channel must be
+   locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          struct iov_pos *pos)
+{
+  struct channel *c = d->channel;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 1
+                     ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % d->multiple == 0)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      input_sector (c, next_sector (pos));
+    }
+}
+
+/* Writes CNT sectors, between 1 and MAX_SECTORS_PER_COMMAND,
+   starting at SEC_NO to disk D from the scatter-gather list at
+   *POS by PIO, with one interrupt per DRQ block of D->multiple
+   sectors, and advances *POS past them.  D's channel must be
+   locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           struct iov_pos *pos)
+{
+  struct channel *c = d->channel;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 1
+                     ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % d->multiple == 0 && !wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + i);
+      output_sector (c, next_sector (pos));
+      if (i % d->multiple == d->multiple - 1 || i == cnt - 1)
+        sema_down (&c->completion_wait);
+    }
+}
+
+/* Moves the sectors starting at SEC_NO between disk D and the
+   IOV_CNT segments of IOV: into memory if WRITE is false, out of
+   it if WRITE is true.  Each command moves up to
+   MAX_SECTORS_PER_COMMAND sectors, by DMA if possible, otherwise
+   by PIO. */
+static void
+ide_transfer (struct ata_disk *d, block_sector_t sec_no,
+              const struct block_iov *iov, size_t iov_cnt, bool write)
+{
+  struct channel *c = d->channel;
+  struct iov_pos pos;
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    cnt += iov[i].cnt;
+  pos.iov = iov;
+  pos.ofs = 0;
+
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_SECTORS_PER_COMMAND ? cnt : MAX_SECTORS_PER_COMMAND;
+
+      lock_acquire (&c->lock);
+      if (!dma_transfer (d, sec_no, n, &pos, write))
+        {
+          if (write)
+            pio_write (d, sec_no, n, &pos);
+          else
+            pio_read (d, sec_no, n, &pos);
+        }
+      lock_release (&c->lock);
+
+      sec_no += n;
+      cnt -= n;
+    }
+}
+
+/* Reads the sectors starting at SEC_NO from disk D into the
+   IOV_CNT segments of IOV.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_readv (void *d, block_sector_t sec_no,
+           const struct block_iov *iov, size_t iov_cnt)
+{
+  ide_transfer (d, sec_no, iov, iov_cnt, false);
+}
+
+/* Writes the sectors starting at SEC_NO to disk D from the
+   IOV_CNT segments of IOV.  Returns after the disk has
+   acknowledged receiving all of the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_writev (void *d, block_sector_t sec_no,
+            const struct block_iov *iov, size_t iov_cnt)
+{
+  ide_transfer (d, sec_no, iov, iov_cnt, true);
+}
+
 /* Reads sector SEC_NO from disk D into BUFFER, which must have
    room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read (void *d, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  struct block_iov iov;
+
+  iov.buffer = buffer;
+  iov.cnt = 1;
+  ide_transfer (d, sec_no, &iov, 1, false);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -362,38 +752,37 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  struct block_iov iov;
+
+  iov.buffer = (void *) buffer;
+  iov.cnt = 1;
+  ide_transfer (d, sec_no, &iov, 1, true);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_readv,
+    ide_writev
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, which must be between 1 and
+   MAX_SECTORS_PER_COMMAND, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_SECTORS_PER_COMMAND);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTORS_PER_COMMAND ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
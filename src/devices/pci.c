@@ -0,0 +1,244 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include <round.h>
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/vaddr.h"
+
+/* The code in this file accesses PCI configuration space through
+   configuration mechanism #1, which every PC chipset that Pintos
+   runs on (and QEMU and Bochs) provides.  See [PCI]. */
+
+/* Configuration mechanism #1 I/O ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Selects a register. */
+#define PCI_CONFIG_DATA 0xcfc           /* Accesses the selected one. */
+
+/* Selects configuration register REG, which must be 4-byte
+   aligned, of function ADDR. */
+static void
+select_register (struct pci_addr addr, uint8_t reg)
+{
+  ASSERT (addr.dev < 32 && addr.func < 8);
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (addr.bus << 16) | (addr.dev << 11) | (addr.func << 8)
+        | (reg & 0xfc));
+}
+
+/* Returns the 32-bit configuration register REG of ADDR. */
+uint32_t
+pci_read32 (struct pci_addr addr, uint8_t reg)
+{
+  select_register (addr, reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Returns the 16-bit configuration register REG of ADDR. */
+uint16_t
+pci_read16 (struct pci_addr addr, uint8_t reg)
+{
+  return pci_read32 (addr, reg) >> ((reg & 2) * 8);
+}
+
+/* Returns the 8-bit configuration register REG of ADDR. */
+uint8_t
+pci_read8 (struct pci_addr addr, uint8_t reg)
+{
+  return pci_read32 (addr, reg) >> ((reg & 3) * 8);
+}
+
+/* Sets the 32-bit configuration register REG of ADDR to DATA. */
+void
+pci_write32 (struct pci_addr addr, uint8_t reg, uint32_t data)
+{
+  select_register (addr, reg);
+  outl (PCI_CONFIG_DATA, data);
+}
+
+/* Sets the 16-bit configuration register REG of ADDR to DATA. */
+void
+pci_write16 (struct pci_addr addr, uint8_t reg, uint16_t data)
+{
+  select_register (addr, reg);
+  outw (PCI_CONFIG_DATA + (reg & 2), data);
+}
+
+/* Calls MATCH on every function present on the PCI buses with AUX
+   until it has returned true N + 1 times, and stores the address
+   of the last such function in *ADDR.  Returns false if there are
+   not that many matches. */
+static bool
+scan (bool (*match) (struct pci_addr, const void *aux), const void *aux,
+      int n, struct pci_addr *addr)
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++)
+        {
+          struct pci_addr a = { bus, dev, func };
+
+          if (pci_read16 (a, PCI_REG_VENDOR) == 0xffff)
+            {
+              if (func == 0)
+                break;
+              continue;
+            }
+          if (match (a, aux) && n-- == 0)
+            {
+              *addr = a;
+              return true;
+            }
+
+          /* Only multi-function devices have functions 1...7. */
+          if (func == 0 && !(pci_read8 (a, PCI_REG_HEADER) & 0x80))
+            break;
+        }
+  return false;
+}
+
+/* scan() callback that matches the class and subclass in the
+   two-byte array AUX. */
+static bool
+match_class (struct pci_addr a, const void *aux)
+{
+  const uint8_t *class = aux;
+  return (pci_read8 (a, PCI_REG_CLASS) == class[0]
+          && pci_read8 (a, PCI_REG_SUBCLASS) == class[1]);
+}
+
+/* scan() callback that matches the vendor and device IDs in the
+   two-element array AUX. */
+static bool
+match_device (struct pci_addr a, const void *aux)
+{
+  const uint16_t *id = aux;
+  return (pci_read16 (a, PCI_REG_VENDOR) == id[0]
+          && pci_read16 (a, PCI_REG_DEVICE) == id[1]);
+}
+
+/* Finds the Nth (counting from 0) PCI function with the given
+   CLASS and SUBCLASS codes and stores its address in *ADDR.
+   Returns true if successful, false if there is no such
+   function. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, int n,
+                struct pci_addr *addr)
+{
+  uint8_t aux[2] = { class, subclass };
+  return scan (match_class, aux, n, addr);
+}
+
+/* Finds the Nth (counting from 0) PCI function with the given
+   VENDOR and DEVICE IDs and stores its address in *ADDR.
+   Returns true if successful, false if there is no such
+   function. */
+bool
+pci_find_device (uint16_t vendor, uint16_t device, int n,
+                 struct pci_addr *addr)
+{
+  uint16_t aux[2] = { vendor, device };
+  return scan (match_device, aux, n, addr);
+}
+
+/* Returns the base address in base address register BAR (0...5)
+   of ADDR, with the flag bits masked off: an I/O port number for
+   an I/O space BAR, a physical address for a memory BAR. */
+uint32_t
+pci_bar (struct pci_addr addr, int bar)
+{
+  uint32_t value;
+
+  ASSERT (bar >= 0 && bar < 6);
+  value = pci_read32 (addr, PCI_REG_BAR0 + bar * 4);
+  return value & 1 ? value & ~3u : value & ~15u;
+}
+
+/* Kernel virtual addresses at which pci_map_mem() maps device
+   memory: the top 4 MB of the address space, far above the RAM
+   that Pintos maps starting at PHYS_BASE. */
+#define MMIO_BASE 0xffc00000
+static uintptr_t mmio_next = MMIO_BASE;
+
+/* Maps the SIZE bytes of device memory at physical address PHYS,
+   typically from a memory BAR, into kernel virtual memory with
+   caching disabled, and returns its kernel virtual address.
+
+   The mapping goes into init_page_dir, which each process's page
+   directory copies when it is created, so this must be called
+   during boot, before any user process starts. */
+void *
+pci_map_mem (uint32_t phys, size_t size)
+{
+  uint32_t *pde = init_page_dir + pd_no ((void *) MMIO_BASE);
+  uint32_t *pt;
+  uintptr_t va;
+  size_t ofs;
+
+  if (*pde == 0)
+    *pde = pde_create (palloc_get_page (PAL_ASSERT | PAL_ZERO));
+  pt = pde_get_pt (*pde);
+
+  size = ROUND_UP (size + (phys & PGMASK), PGSIZE);
+  ASSERT (size <= -mmio_next);
+  va = mmio_next;
+  mmio_next += size;
+  for (ofs = 0; ofs < size; ofs += PGSIZE)
+    pt[pt_no ((void *) (va + ofs))]
+      = ((phys & ~PGMASK) + ofs) | PTE_P | PTE_W | PTE_PCD;
+  return (void *) (va + (phys & PGMASK));
+}
+
+/* PCI interrupt lines are level-triggered and shared: functions
+   of different devices, and of different drivers, may use the
+   same line.  The interrupt controller allows only one handler
+   per vector, so the handlers for each line are kept here and
+   called in turn, and each checks whether its own function
+   raised the interrupt. */
+
+/* Maximum number of handlers on one interrupt line. */
+#define MAX_IRQ_HANDLERS 8
+
+/* A handler registered with pci_register_irq(). */
+struct irq_handler
+  {
+    pci_irq_handler_func *func;
+    void *aux;
+  };
+
+/* Handlers for each of the 16 legacy interrupt lines. */
+static struct irq_handler irq_handlers[16][MAX_IRQ_HANDLERS];
+static size_t irq_handler_cnt[16];
+
+/* Calls every handler registered for the line that interrupted. */
+static void
+irq_dispatch (struct intr_frame *f)
+{
+  int irq = f->vec_no - 0x20;
+  size_t i;
+
+  for (i = 0; i < irq_handler_cnt[irq]; i++)
+    irq_handlers[irq][i].func (irq_handlers[irq][i].aux);
+}
+
+/* Arranges for FUNC to be called with AUX whenever interrupt line
+   IRQ (0...15), as read from a function's PCI_REG_IRQ register,
+   is raised, along with any other handlers already registered
+   for it.  Must be called during boot. */
+void
+pci_register_irq (uint8_t irq, pci_irq_handler_func *func, void *aux)
+{
+  struct irq_handler *h;
+
+  ASSERT (irq < 16);
+  if (irq_handler_cnt[irq] >= MAX_IRQ_HANDLERS)
+    PANIC ("too many handlers for PCI interrupt line %d", irq);
+  h = &irq_handlers[irq][irq_handler_cnt[irq]];
+  h->func = func;
+  h->aux = aux;
+  if (irq_handler_cnt[irq]++ == 0)
+    intr_register_ext (irq + 0x20, irq_dispatch, "PCI");
+}
@@ -0,0 +1,279 @@
+#include "devices/raid0.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The code in this file is a virtual block device, "md0", that
+   stripes its sectors across several member block devices
+   (RAID level 0).  Stripe I, that is, sectors I * STRIPE through
+   (I + 1) * STRIPE - 1, lives on member I % MEMBER_CNT, as that
+   member's stripe I / MEMBER_CNT.  There is no redundancy: losing
+   any member loses the device.
+
+   A transfer is split at stripe boundaries.  The pieces are
+   submitted to the members' request queues all at once, so that
+   members on different channels or controllers work on them at
+   the same time, and the transfer is done when the last piece
+   is. */
+
+/* Most member devices. */
+#define MAX_MEMBERS 8
+
+/* The striped device. */
+struct raid0
+  {
+    struct block *members[MAX_MEMBERS]; /* Member devices. */
+    size_t member_cnt;                  /* Number of members. */
+    block_sector_t stripe;              /* Sectors per stripe. */
+  };
+
+static struct raid0 md0;
+
+/* One piece of a transfer, on one member. */
+struct raid0_piece
+  {
+    struct block_request request;       /* Request to the member. */
+    struct block_iov iov[];             /* Request's segments. */
+  };
+
+static struct block_operations raid0_operations;
+
+/* Panics if BLOCK, or a partition of it, is of a type that Pintos
+   may cast in a role of its own, such as the file system or
+   scratch device.  That role would then write straight onto one
+   of md0's members and corrupt md0. */
+static void
+check_member (struct block *block)
+{
+  struct block *b;
+
+  for (b = block_first (); b != NULL; b = block_next (b))
+    if ((b == block || block_parent (b) == block)
+        && block_type (b) < BLOCK_ROLE_CNT)
+      PANIC ("md0: %s is a %s device and cannot be a member",
+             block_name (b), block_type_name (block_type (b)));
+}
+
+/* Creates md0, striped across the block devices named in
+   MEMBERS, a comma-separated list, with STRIPE sectors per
+   stripe, and registers it with the block layer as a file system
+   device.  Does nothing if MEMBERS is a null pointer.  Modifies
+   MEMBERS. */
+void
+raid0_init (char *members, block_sector_t stripe)
+{
+  block_sector_t member_size, size;
+  char extra_info[128];
+  char *name, *save_ptr;
+  struct block *block;
+  size_t i;
+
+  if (members == NULL)
+    return;
+  if (stripe == 0)
+    PANIC ("md0: stripe size must be at least 1 sector");
+
+  snprintf (extra_info, sizeof extra_info, "RAID-0, %'"PRDSNu"-sector stripes"
+            " across", stripe);
+  member_size = (block_sector_t) -1;
+  for (name = strtok_r (members, ",", &save_ptr); name != NULL;
+       name = strtok_r (NULL, ",", &save_ptr))
+    {
+      block = block_get_by_name (name);
+      if (block == NULL)
+        PANIC ("md0: no such block device \"%s\"", name);
+      if (block_type (block) == BLOCK_FOREIGN)
+        PANIC ("md0: %s belongs to another operating system", name);
+      check_member (block);
+      if (md0.member_cnt >= MAX_MEMBERS)
+        PANIC ("md0: more than %d members", MAX_MEMBERS);
+      for (i = 0; i < md0.member_cnt; i++)
+        if (md0.members[i] == block)
+          PANIC ("md0: %s listed twice", name);
+
+      md0.members[md0.member_cnt++] = block;
+      if (block_size (block) < member_size)
+        member_size = block_size (block);
+      snprintf (extra_info + strlen (extra_info),
+                sizeof extra_info - strlen (extra_info), " %s", name);
+    }
+  if (md0.member_cnt == 0)
+    PANIC ("md0: no member devices");
+  md0.stripe = stripe;
+
+  /* Use as many whole stripes as the smallest member has. */
+  size = member_size / stripe * stripe * md0.member_cnt;
+  if (size == 0)
+    PANIC ("md0: members are smaller than one stripe");
+
+  block = block_register ("md0", BLOCK_FILESYS, extra_info, size,
+                          &raid0_operations, &md0);
+  block_set_queue_depth (block, md0.member_cnt);
+}
+
+/* Position within a scatter-gather list. */
+struct iov_pos
+  {
+    const struct block_iov *iov;        /* Current segment. */
+    size_t ofs;                         /* Sectors into it. */
+  };
+
+/* Fills IOV, if nonnull, with the segments that make up the CNT
+   sectors at *POS, and returns the number of them.  Advances *POS
+   past them if ADVANCE is true. */
+static size_t
+take_segments (struct iov_pos *pos, size_t cnt, struct block_iov *iov,
+               bool advance)
+{
+  struct iov_pos p = *pos;
+  size_t seg_cnt = 0;
+
+  while (cnt > 0)
+    {
+      size_t n = p.iov->cnt - p.ofs;
+      if (n > cnt)
+        n = cnt;
+      if (iov != NULL)
+        {
+          iov[seg_cnt].buffer = ((uint8_t *) p.iov->buffer
+                                 + p.ofs * BLOCK_SECTOR_SIZE);
+          iov[seg_cnt].cnt = n;
+        }
+      seg_cnt++;
+      cnt -= n;
+      p.ofs += n;
+      if (p.ofs == p.iov->cnt)
+        {
+          p.iov++;
+          p.ofs = 0;
+        }
+    }
+  if (advance)
+    *pos = p;
+  return seg_cnt;
+}
+
+/* Completion function for a piece of a transfer. */
+static void
+piece_complete (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Moves the sectors starting at SECTOR between striped device MD
+   and the IOV_CNT segments of IOV: into memory if WRITE is false,
+   out of it if WRITE is true.  Submits one request per stripe
+   touched to that stripe's member, then waits for them all. */
+static void
+raid0_transfer (struct raid0 *md, block_sector_t sector,
+                const struct block_iov *iov, size_t iov_cnt, bool write)
+{
+  struct raid0_piece **pieces;
+  struct semaphore done;
+  struct iov_pos pos;
+  size_t total = 0;
+  size_t piece_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    total += iov[i].cnt;
+  if (total == 0)
+    return;
+
+  pieces = malloc ((total / md->stripe + 2) * sizeof *pieces);
+  if (pieces == NULL)
+    PANIC ("md0: out of memory");
+  sema_init (&done, 0);
+  pos.iov = iov;
+  pos.ofs = 0;
+  while (total > 0)
+    {
+      block_sector_t stripe_no = sector / md->stripe;
+      block_sector_t ofs = sector % md->stripe;
+      size_t cnt = md->stripe - ofs;
+      struct raid0_piece *p;
+      size_t seg_cnt;
+
+      if (cnt > total)
+        cnt = total;
+      seg_cnt = take_segments (&pos, cnt, NULL, false);
+      p = malloc (sizeof *p + seg_cnt * sizeof *p->iov);
+      if (p == NULL)
+        PANIC ("md0: out of memory");
+      take_segments (&pos, cnt, p->iov, true);
+
+      p->request.write = write;
+      p->request.sector = stripe_no / md->member_cnt * md->stripe + ofs;
+      p->request.cnt = cnt;
+      p->request.buffer = NULL;
+      p->request.iov = p->iov;
+      p->request.iov_cnt = seg_cnt;
+      p->request.complete = piece_complete;
+      p->request.aux = &done;
+      pieces[piece_cnt++] = p;
+      block_submit (md->members[stripe_no % md->member_cnt], &p->request);
+
+      sector += cnt;
+      total -= cnt;
+    }
+
+  for (i = 0; i < piece_cnt; i++)
+    sema_down (&done);
+  for (i = 0; i < piece_cnt; i++)
+    free (pieces[i]);
+  free (pieces);
+}
+
+/* Reads the sectors starting at SECTOR from striped device MD
+   into the IOV_CNT segments of IOV. */
+static void
+raid0_readv (void *md, block_sector_t sector,
+             const struct block_iov *iov, size_t iov_cnt)
+{
+  raid0_transfer (md, sector, iov, iov_cnt, false);
+}
+
+/* Writes the sectors starting at SECTOR to striped device MD from
+   the IOV_CNT segments of IOV.  Returns after every member has
+   acknowledged receiving its data. */
+static void
+raid0_writev (void *md, block_sector_t sector,
+              const struct block_iov *iov, size_t iov_cnt)
+{
+  raid0_transfer (md, sector, iov, iov_cnt, true);
+}
+
+/* Reads sector SECTOR from striped device MD into BUFFER, which
+   must have room for BLOCK_SECTOR_SIZE bytes. */
+static void
+raid0_read (void *md, block_sector_t sector, void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = buffer;
+  iov.cnt = 1;
+  raid0_transfer (md, sector, &iov, 1, false);
+}
+
+/* Writes sector SECTOR to striped device MD from BUFFER, which
+   must contain BLOCK_SECTOR_SIZE bytes.  Returns after the member
+   has acknowledged receiving the data. */
+static void
+raid0_write (void *md, block_sector_t sector, const void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = (void *) buffer;
+  iov.cnt = 1;
+  raid0_transfer (md, sector, &iov, 1, true);
+}
+
+static struct block_operations raid0_operations =
+  {
+    raid0_read,
+    raid0_write,
+    raid0_readv,
+    raid0_writev
+  };
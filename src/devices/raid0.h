@@ -0,0 +1,11 @@
+#ifndef DEVICES_RAID0_H
+#define DEVICES_RAID0_H
+
+#include "devices/block.h"
+
+/* Default stripe size, in sectors. */
+#define RAID0_DEFAULT_STRIPE 16
+
+void raid0_init (char *members, block_sector_t stripe);
+
+#endif /* devices/raid0.h */
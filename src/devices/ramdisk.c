@@ -0,0 +1,178 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a block device kept in kernel memory,
+   named "ram0".  It has no partition table and no role of its own;
+   use it with e.g. "-filesys=ram0" or "-scratch=ram0".  Its contents
+   are lost at power off.
+
+   The disk is an array of pages, which need not be contiguous, so
+   that a large disk does not need a large contiguous run of
+   physical memory. */
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* The RAM disk. */
+static uint8_t **pages;         /* Pages holding the data. */
+static size_t page_cnt;         /* Number of pages. */
+
+static struct block_operations ramdisk_operations;
+
+static struct block *find_scratch (const char *name);
+static void load (struct block *ram, struct block *from);
+
+/* Creates a RAM disk of SIZE sectors and registers it with the
+   block device layer.  If LOAD_SCRATCH is true, the disk is
+   initialized from the scratch device, the one named SCRATCH_NAME
+   if it is nonnull, and SIZE may be 0 to make the disk the same
+   size.  Does nothing if SIZE is 0 and LOAD_SCRATCH is false. */
+void
+ramdisk_init (block_sector_t size, bool load_scratch,
+              const char *scratch_name)
+{
+  struct block *scratch = NULL;
+  struct block *block;
+  char extra_info[64];
+  size_t i;
+
+  if (load_scratch)
+    {
+      scratch = find_scratch (scratch_name);
+      if (scratch == NULL && scratch_name != NULL)
+        PANIC ("ram0: scratch device \"%s\" to load from does not exist",
+               scratch_name);
+      if (scratch == NULL)
+        PANIC ("ram0: no scratch device to load from");
+      if (size == 0)
+        size = block_size (scratch);
+    }
+  if (size == 0)
+    return;
+
+  /* Allocate. */
+  page_cnt = DIV_ROUND_UP (size, SECTORS_PER_PAGE);
+  pages = malloc (page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC ("ram0: out of memory for %'"PRDSNu" sectors", size);
+  for (i = 0; i < page_cnt; i++)
+    {
+      pages[i] = palloc_get_page (PAL_ZERO);
+      if (pages[i] == NULL)
+        PANIC ("ram0: out of memory for %'"PRDSNu" sectors", size);
+    }
+
+  /* Register. */
+  if (scratch != NULL)
+    snprintf (extra_info, sizeof extra_info, "RAM disk, loaded from %s",
+              block_name (scratch));
+  else
+    strlcpy (extra_info, "RAM disk", sizeof extra_info);
+  block = block_register ("ram0", BLOCK_RAW, extra_info, size,
+                          &ramdisk_operations, NULL);
+  if (scratch != NULL)
+    load (block, scratch);
+}
+
+/* Returns the device that locate_block_devices() will use for
+   scratch: the one named NAME, if NAME is nonnull, and otherwise
+   the first one in probe order of type BLOCK_SCRATCH.  Returns a
+   null pointer if there is none. */
+static struct block *
+find_scratch (const char *name)
+{
+  struct block *block;
+
+  if (name != NULL)
+    return block_get_by_name (name);
+  for (block = block_first (); block != NULL; block = block_next (block))
+    if (block_type (block) == BLOCK_SCRATCH)
+      return block;
+  return NULL;
+}
+
+/* Copies the contents of FROM into RAM, a page at a time, as
+   far as both go. */
+static void
+load (struct block *ram, struct block *from)
+{
+  block_sector_t size = block_size (ram);
+  block_sector_t sector;
+
+  if (size > block_size (from))
+    size = block_size (from);
+  for (sector = 0; sector < size; sector += SECTORS_PER_PAGE)
+    {
+      size_t cnt = size - sector;
+      if (cnt > SECTORS_PER_PAGE)
+        cnt = SECTORS_PER_PAGE;
+      block_read_range (from, sector, cnt, pages[sector / SECTORS_PER_PAGE]);
+    }
+}
+
+/* Returns the address of sector SECTOR. */
+static uint8_t *
+sector_addr (block_sector_t sector)
+{
+  ASSERT (sector / SECTORS_PER_PAGE < page_cnt);
+  return (pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+static void
+ramdisk_read (void *aux UNUSED, block_sector_t sector, void *buffer)
+{
+  memcpy (buffer, sector_addr (sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes sector SECTOR from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes. */
+static void
+ramdisk_write (void *aux UNUSED, block_sector_t sector, const void *buffer)
+{
+  memcpy (sector_addr (sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads the sectors starting at SECTOR into the IOV_CNT segments
+   of IOV. */
+static void
+ramdisk_readv (void *aux UNUSED, block_sector_t sector,
+               const struct block_iov *iov, size_t iov_cnt)
+{
+  size_t i, j;
+
+  for (i = 0; i < iov_cnt; i++)
+    for (j = 0; j < iov[i].cnt; j++)
+      memcpy ((uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE,
+              sector_addr (sector++), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes the sectors starting at SECTOR from the IOV_CNT
+   segments of IOV. */
+static void
+ramdisk_writev (void *aux UNUSED, block_sector_t sector,
+                const struct block_iov *iov, size_t iov_cnt)
+{
+  size_t i, j;
+
+  for (i = 0; i < iov_cnt; i++)
+    for (j = 0; j < iov[i].cnt; j++)
+      memcpy (sector_addr (sector++),
+              (uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE,
+              BLOCK_SECTOR_SIZE);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_readv,
+    ramdisk_writev
+  };
@@ -0,0 +1,10 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+void ramdisk_init (block_sector_t size, bool load_scratch,
+                   const char *scratch_name);
+
+#endif /* devices/ramdisk.h */
@@ -0,0 +1,408 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/io.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a driver for virtio block devices,
+   such as those QEMU provides for "-drive if=virtio", through
+   the legacy PCI interface of [Virtio] 0.9.5.  Each disk has a
+   single virtqueue.  Any number of threads may have requests on
+   it at once; the interrupt handler wakes each one up as the
+   device reports its request used. */
+
+/* PCI IDs of a legacy virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio I/O port addresses, relative to BAR 0. */
+#define reg_guest_features(D) ((D)->io_base + 0x04)  /* 32 bits. */
+#define reg_queue_pfn(D) ((D)->io_base + 0x08)       /* 32 bits. */
+#define reg_queue_size(D) ((D)->io_base + 0x0c)      /* 16 bits. */
+#define reg_queue_select(D) ((D)->io_base + 0x0e)    /* 16 bits. */
+#define reg_queue_notify(D) ((D)->io_base + 0x10)    /* 16 bits. */
+#define reg_status(D) ((D)->io_base + 0x12)          /* 8 bits. */
+#define reg_isr(D) ((D)->io_base + 0x13)             /* 8 bits, r/o. */
+#define reg_capacity(D) ((D)->io_base + 0x14)        /* 64 bits, r/o. */
+
+/* Device Status bits. */
+#define STATUS_ACKNOWLEDGE 0x01 /* Guest has noticed the device. */
+#define STATUS_DRIVER 0x02      /* Guest has a driver for it. */
+#define STATUS_DRIVER_OK 0x04   /* Driver is ready. */
+#define STATUS_FAILED 0x80      /* Driver gave up on the device. */
+
+/* Virtqueue descriptor. */
+struct vring_desc
+  {
+    uint64_t addr;              /* Physical address of buffer. */
+    uint32_t len;               /* Length of buffer in bytes. */
+    uint16_t flags;             /* VRING_DESC_F_*. */
+    uint16_t next;              /* Next descriptor, with VRING_DESC_F_NEXT. */
+  };
+#define VRING_DESC_F_NEXT 1     /* Chain continues at NEXT. */
+#define VRING_DESC_F_WRITE 2    /* Device writes, rather than reads. */
+
+/* Virtqueue available ring, written by the driver. */
+struct vring_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry goes, mod size. */
+    uint16_t ring[];            /* Heads of descriptor chains. */
+  };
+
+/* Virtqueue used ring, written by the device. */
+struct vring_used_elem
+  {
+    uint32_t id;                /* Head of a used descriptor chain. */
+    uint32_t len;               /* Bytes written into it. */
+  };
+struct vring_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry goes, mod size. */
+    struct vring_used_elem ring[];
+  };
+
+/* Block request header, read by the device. */
+struct vblk_header
+  {
+    uint32_t type;              /* VIRTIO_BLK_T_*. */
+    uint32_t reserved;
+    uint64_t sector;            /* First sector. */
+  };
+#define VIRTIO_BLK_T_IN 0       /* Read. */
+#define VIRTIO_BLK_T_OUT 1      /* Write. */
+#define VIRTIO_BLK_S_OK 0       /* Status byte for success. */
+
+/* Most transfers the block layer keeps in flight on one disk. */
+#define VIRTIO_BLK_QUEUE_DEPTH 8
+
+/* A request on a virtqueue.  Lives on the requesting thread's
+   stack, which is kernel memory that the device can reach. */
+struct vblk_request
+  {
+    struct vblk_header header;  /* Read by the device. */
+    uint8_t status;             /* Written by the device. */
+    struct semaphore done;      /* Up'd by interrupt handler. */
+  };
+
+/* A virtio block device. */
+struct vblk_disk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base I/O port. */
+    uint8_t irq;                /* PCI interrupt line. */
+
+    uint16_t queue_size;        /* Entries in the virtqueue. */
+    struct vring_desc *desc;    /* Descriptor table. */
+    struct vring_avail *avail;  /* Available ring. */
+    volatile struct vring_used *used;   /* Used ring. */
+    uint16_t last_used;         /* used->idx already handled. */
+    struct vblk_request **pending;      /* Request for each chain head. */
+
+    struct lock lock;           /* Protects the members below. */
+    struct condition desc_free; /* Signaled when descriptors are freed. */
+    uint16_t free_head;         /* First free descriptor. */
+    size_t free_cnt;            /* Number of free descriptors. */
+  };
+
+/* We support a few disks, named vda, vdb, ... in PCI order. */
+#define MAX_DISKS 4
+static struct vblk_disk disks[MAX_DISKS];
+static size_t disk_cnt;
+
+static struct block_operations vblk_operations;
+
+static bool setup_disk (struct vblk_disk *, struct pci_addr);
+static void interrupt_handler (void *disk);
+
+/* Finds the virtio block devices on the PCI bus, sets them up,
+   and registers them with the block layer. */
+void
+virtio_blk_init (void)
+{
+  struct pci_addr a;
+  int n;
+
+  for (n = 0; disk_cnt < MAX_DISKS
+         && pci_find_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, n, &a); n++)
+    {
+      struct vblk_disk *d = &disks[disk_cnt];
+      char extra_info[64];
+      uint64_t capacity;
+      struct block *block;
+
+      snprintf (d->name, sizeof d->name, "vd%c", 'a' + (int) disk_cnt);
+      if (!setup_disk (d, a))
+        continue;
+      disk_cnt++;
+
+      pci_register_irq (d->irq, interrupt_handler, d);
+      outb (reg_status (d),
+            STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+      capacity = inl (reg_capacity (d))
+                 | (uint64_t) inl (reg_capacity (d) + 4) << 32;
+      if (capacity > UINT32_MAX)
+        capacity = UINT32_MAX;
+      snprintf (extra_info, sizeof extra_info,
+                "virtio, %"PRIu16"-entry queue", d->queue_size);
+      block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
+                              &vblk_operations, d);
+      block_set_queue_depth (block, VIRTIO_BLK_QUEUE_DEPTH);
+      partition_scan (block);
+    }
+}
+
+/* Resets the virtio block device at A, negotiates no optional
+   features, and sets up its virtqueue in D.  Returns true if
+   successful, false if the device could not be used. */
+static bool
+setup_disk (struct vblk_disk *d, struct pci_addr a)
+{
+  size_t avail_size, used_ofs, size;
+  uint8_t *vring;
+  uint8_t irq;
+  size_t i;
+
+  if (!(pci_read32 (a, PCI_REG_BAR0) & 1))
+    return false;
+  irq = pci_read8 (a, PCI_REG_IRQ);
+  if (irq >= 16)
+    {
+      printf ("%s: no usable interrupt line\n", d->name);
+      return false;
+    }
+  d->io_base = pci_bar (a, 0);
+  d->irq = irq;
+  pci_write16 (a, PCI_REG_COMMAND,
+               pci_read16 (a, PCI_REG_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset the device and tell it we drive it. */
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  outl (reg_guest_features (d), 0);
+
+  /* Lay out queue 0: the descriptor table and available ring,
+     then the used ring on the next page boundary, in physically
+     contiguous, page-aligned memory. */
+  outw (reg_queue_select (d), 0);
+  d->queue_size = inw (reg_queue_size (d));
+  if (d->queue_size < 3)
+    goto fail;
+  avail_size = sizeof (struct vring_desc) * d->queue_size
+               + sizeof (struct vring_avail) + 2 * (d->queue_size + 1);
+  used_ofs = ROUND_UP (avail_size, PGSIZE);
+  size = used_ofs + ROUND_UP (sizeof (struct vring_used) + 2
+                              + sizeof (struct vring_used_elem) * d->queue_size,
+                              PGSIZE);
+  vring = palloc_get_multiple (PAL_ZERO, size / PGSIZE);
+  d->pending = calloc (d->queue_size, sizeof *d->pending);
+  if (vring == NULL || d->pending == NULL)
+    {
+      printf ("%s: out of memory for virtqueue\n", d->name);
+      goto fail;
+    }
+  d->desc = (struct vring_desc *) vring;
+  d->avail = (struct vring_avail *) (vring + sizeof (struct vring_desc)
+                                     * d->queue_size);
+  d->used = (struct vring_used *) (vring + used_ofs);
+  d->last_used = 0;
+  outl (reg_queue_pfn (d), vtop (vring) / PGSIZE);
+
+  lock_init (&d->lock);
+  cond_init (&d->desc_free);
+  for (i = 0; i < d->queue_size; i++)
+    d->desc[i].next = i + 1;
+  d->free_head = 0;
+  d->free_cnt = d->queue_size;
+  return true;
+
+ fail:
+  outb (reg_status (d), STATUS_FAILED);
+  return false;
+}
+
+/* Takes a descriptor off D's free list and returns its index.
+   D's lock must be held and a descriptor must be free. */
+static uint16_t
+alloc_desc (struct vblk_disk *d)
+{
+  uint16_t i = d->free_head;
+
+  ASSERT (d->free_cnt > 0);
+  d->free_head = d->desc[i].next;
+  d->free_cnt--;
+  return i;
+}
+
+/* Fills descriptor I of D to describe the SIZE bytes at BUFFER,
+   which must be in kernel memory, with FLAGS, and chains it to
+   NEXT if FLAGS includes VRING_DESC_F_NEXT. */
+static void
+fill_desc (struct vblk_disk *d, uint16_t i, const void *buffer, size_t size,
+           uint16_t flags, uint16_t next)
+{
+  ASSERT (is_kernel_vaddr (buffer));
+  d->desc[i].addr = vtop (buffer);
+  d->desc[i].len = size;
+  d->desc[i].flags = flags;
+  d->desc[i].next = next;
+}
+
+/* Moves the sectors starting at SECTOR between disk D and the
+   IOV_CNT segments of IOV, which must be in kernel memory: into
+   memory if WRITE is false, out of it if WRITE is true.  Puts a
+   single descriptor chain on D's virtqueue and sleeps until the
+   device has used it, so other threads' requests may be in
+   flight at the same time. */
+static void
+vblk_transfer (struct vblk_disk *d, block_sector_t sector,
+               const struct block_iov *iov, size_t iov_cnt, bool write)
+{
+  struct vblk_request r;
+  uint16_t data_flags = write ? 0 : VRING_DESC_F_WRITE;
+  uint16_t head, prev, i;
+  size_t j;
+
+  ASSERT (iov_cnt + 2 <= d->queue_size);
+
+  r.header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  r.header.reserved = 0;
+  r.header.sector = sector;
+  r.status = 0xff;
+  sema_init (&r.done, 0);
+
+  lock_acquire (&d->lock);
+  while (d->free_cnt < iov_cnt + 2)
+    cond_wait (&d->desc_free, &d->lock);
+
+  /* Header, data segments, status byte. */
+  head = prev = alloc_desc (d);
+  fill_desc (d, head, &r.header, sizeof r.header, 0, 0);
+  for (j = 0; j < iov_cnt; j++)
+    {
+      i = alloc_desc (d);
+      d->desc[prev].flags |= VRING_DESC_F_NEXT;
+      d->desc[prev].next = i;
+      fill_desc (d, i, iov[j].buffer, iov[j].cnt * BLOCK_SECTOR_SIZE,
+                 data_flags, 0);
+      prev = i;
+    }
+  i = alloc_desc (d);
+  d->desc[prev].flags |= VRING_DESC_F_NEXT;
+  d->desc[prev].next = i;
+  fill_desc (d, i, &r.status, 1, VRING_DESC_F_WRITE, 0);
+
+  /* Make the chain available.  The device must see the ring
+     entry before the new index. */
+  d->pending[head] = &r;
+  d->avail->ring[d->avail->idx % d->queue_size] = head;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  lock_release (&d->lock);
+  outw (reg_queue_notify (d), 0);
+
+  sema_down (&r.done);
+
+  /* Put the chain back on the free list. */
+  lock_acquire (&d->lock);
+  d->pending[head] = NULL;
+  for (i = head; ; i = d->desc[i].next)
+    {
+      d->free_cnt++;
+      if (!(d->desc[i].flags & VRING_DESC_F_NEXT))
+        break;
+    }
+  d->desc[i].next = d->free_head;
+  d->free_head = head;
+  cond_broadcast (&d->desc_free, &d->lock);
+  lock_release (&d->lock);
+
+  if (r.status != VIRTIO_BLK_S_OK)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu" status=%d",
+           d->name, write ? "write" : "read", sector, r.status);
+}
+
+/* Reads the sectors starting at SECTOR from disk D into the
+   IOV_CNT segments of IOV. */
+static void
+vblk_readv (void *d, block_sector_t sector,
+            const struct block_iov *iov, size_t iov_cnt)
+{
+  vblk_transfer (d, sector, iov, iov_cnt, false);
+}
+
+/* Writes the sectors starting at SECTOR to disk D from the
+   IOV_CNT segments of IOV.  Returns after the device has
+   acknowledged receiving all of the data. */
+static void
+vblk_writev (void *d, block_sector_t sector,
+             const struct block_iov *iov, size_t iov_cnt)
+{
+  vblk_transfer (d, sector, iov, iov_cnt, true);
+}
+
+/* Reads sector SECTOR from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+vblk_read (void *d, block_sector_t sector, void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = buffer;
+  iov.cnt = 1;
+  vblk_transfer (d, sector, &iov, 1, false);
+}
+
+/* Write sector SECTOR to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the device has
+   acknowledged receiving the data. */
+static void
+vblk_write (void *d, block_sector_t sector, const void *buffer)
+{
+  struct block_iov iov;
+
+  iov.buffer = (void *) buffer;
+  iov.cnt = 1;
+  vblk_transfer (d, sector, &iov, 1, true);
+}
+
+static struct block_operations vblk_operations =
+  {
+    vblk_read,
+    vblk_write,
+    vblk_readv,
+    vblk_writev
+  };
+
+/* Virtio block interrupt handler for disk D_.  Wakes up the
+   submitter of each request the device has used since the last
+   interrupt. */
+static void
+interrupt_handler (void *d_)
+{
+  struct vblk_disk *d = d_;
+
+  /* Reading the ISR acknowledges the interrupt. */
+  inb (reg_isr (d));
+  while (d->last_used != d->used->idx)
+    {
+      uint32_t id;
+
+      barrier ();
+      id = d->used->ring[d->last_used % d->queue_size].id;
+      ASSERT (id < d->queue_size && d->pending[id] != NULL);
+      sema_up (&d->pending[id]->done);
+      d->last_used++;
+    }
+}
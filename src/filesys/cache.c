@@ -1,31 +1,227 @@
 #include "filesys/cache.h"
 #include <debug.h>
+#include <round.h>
+#include <stdlib.h>
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/palloc.h"
 
+/* The buffer cache is write-back.  cache_write() only updates the
+   cached copy and marks the slot dirty; a dirty slot reaches the
+   disk when it is evicted by cache_evict(), when it has been
+   dirty for DIRTY_EXPIRE_TICKS and the write_behind thread next
+   wakes up (every WRITE_BEHIND_TICKS), when too much of the cache
+   is dirty, or when filesys_done() calls cache_out_all() at
+   shutdown.  Data written less than about DIRTY_EXPIRE_TICKS +
+   WRITE_BEHIND_TICKS ticks ago is therefore lost if the machine
+   stops without a clean shutdown.
 
-static struct buffer_cache cache[MAX_CACHE_SIZE]; 
+   Write-back never invalidates slots, so flushing keeps the cache
+   warm.  Dirty slots are written in sector order, with runs of
+   adjacent dirty sectors written back together. */
+
+static struct buffer_cache *cache;     /* cache_slot_cnt slots. */
+static size_t cache_slot_cnt;           /* Slots, with or without a page. */
+static uint8_t **cache_pages;           /* Page for each group of slots. */
+static size_t cache_page_cnt;           /* Pages currently allocated. */
+static size_t cache_valid_cnt;          /* Slots holding a sector. */
+static size_t cache_dirty_cnt;          /* Slots holding unwritten data. */
 struct lock cache_lock;
 int clock_ptr;
 
+size_t cache_max_sectors = MAX_CACHE_SIZE;
+enum cache_policy cache_policy = CACHE_POLICY_CLOCK;
 
-void 
-write_behind()
+/* Statistics, protected by cache_lock. */
+static struct cache_stats cache_stats;
+
+/* Internal cache_get_slot() mode flag: the access is a read-ahead,
+   not a use, and is counted separately. */
+#define CACHE_PREFETCH 8
+
+/* Index of the valid slots, keyed by sector_id. */
+static struct hash cache_index;
+
+/* For read ahead */
+static struct condition read_ahead_cond;
+static struct lock read_ahead_lock;
+static struct list read_ahead_list;
+static size_t read_ahead_cnt;           /* Entries in read_ahead_list. */
+
+/* 2Q state.  See twoq_evict(). */
+static struct list twoq_a1in;           /* Slots, most recent first. */
+static size_t twoq_a1in_cnt;            /* Slots on twoq_a1in. */
+static struct list twoq_am;             /* Slots, most recent first. */
+static struct list twoq_a1out;          /* Ghosts, most recent first. */
+static struct list twoq_ghost_free;     /* Ghosts not on twoq_a1out. */
+static struct hash twoq_ghost_index;    /* Ghosts on twoq_a1out by sector. */
+
+/* A sector recently evicted from A1in. */
+struct twoq_ghost
+{
+    block_sector_t sector_id;
+    struct hash_elem hash_elem;     /* Element in twoq_ghost_index. */
+    struct list_elem list_elem;     /* Element in twoq_a1out or free list. */
+};
+
+static void clock_ptr_move (void);
+static void cache_lock_acquire (void);
+static void cache_policy_remove (int i);
+static bool cache_grow (void);
+static bool cache_reclaim (void);
+static int cache_get_slot (block_sector_t sector_id, enum cache_mode);
+static int cache_evict (void);
+static int twoq_evict (void);
+static void cache_policy_touch (int i, bool meta);
+static void cache_policy_insert (int i, bool meta);
+static hash_hash_func twoq_ghost_hash;
+static hash_less_func twoq_ghost_less;
+static void cache_flush_dirty (int64_t min_age, size_t target);
+
+/* Records a lookup of SECTOR_ID with the given MODE in the block
+   I/O trace, as a HIT or a miss. */
+static void
+cache_trace (block_sector_t sector_id, enum cache_mode mode, bool hit)
+{
+    unsigned flags = BLOCK_TRACE_CACHE;
+
+    if ((mode & ~(CACHE_META | CACHE_PREFETCH)) != CACHE_READ)
+        flags |= BLOCK_TRACE_WRITE;
+    if (hit)
+        flags |= BLOCK_TRACE_HIT;
+    if (mode & CACHE_META)
+        flags |= BLOCK_TRACE_META;
+    if (mode & CACHE_PREFETCH)
+        flags |= BLOCK_TRACE_PREFETCH;
+    block_trace (fs_device, sector_id, 1, flags);
+}
+
+/* Hashes a slot by its sector number. */
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+    const struct buffer_cache *b = hash_entry (e, struct buffer_cache, hash_elem);
+    return hash_int (b->sector_id);
+}
+
+/* Orders two slots by sector number. */
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+    return hash_entry (a, struct buffer_cache, hash_elem)->sector_id
+           < hash_entry (b, struct buffer_cache, hash_elem)->sector_id;
+}
+
+/* Drops clean slot I from the sector index and marks it free. */
+static void
+cache_invalidate (int i)
+{
+    ASSERT (!cache[i].loading && !cache[i].flushing && !cache[i].dirty);
+    hash_delete (&cache_index, &cache[i].hash_elem);
+    cache_policy_remove (i);
+    if (cache[i].prefetched){
+        cache[i].prefetched = false;
+        cache_stats.prefetch_wasted++;
+    }
+    cache[i].valid = false;
+    cache_valid_cnt--;
+}
+
+/* Marks slot B dirty, noting when it became dirty. */
+static void
+cache_mark_dirty (struct buffer_cache *b)
+{
+    if (!b->dirty){
+        b->dirty = true;
+        b->dirty_since = timer_ticks ();
+        cache_dirty_cnt++;
+    }
+}
+
+/* Returns the number of dirty slots that is PERCENT percent of
+   the slots the cache currently has pages for. */
+static size_t
+cache_dirty_limit (int percent)
+{
+    return cache_page_cnt * CACHE_PAGE_SECTORS * percent / 100;
+}
+
+/* Write-behind thread.  Every WRITE_BEHIND_TICKS, moves the free
+   map's and open inodes' changes into the cache, writes back the
+   slots that have been dirty for DIRTY_EXPIRE_TICKS, and keeps
+   going with younger ones while more than DIRTY_BACKGROUND_RATIO
+   percent of the cache is dirty. */
+static void 
+write_behind (void *aux UNUSED)
 {
     while (true){
-        timer_sleep (1000);
-        cache_out_all ();
+        timer_sleep (WRITE_BEHIND_TICKS);
+        free_map_flush ();
+        inode_flush_all ();
+        cache_lock_acquire ();
+        cache_flush_dirty (DIRTY_EXPIRE_TICKS, 0);
+        if (cache_dirty_cnt > cache_dirty_limit (DIRTY_BACKGROUND_RATIO))
+            cache_flush_dirty (0, cache_dirty_limit (DIRTY_BACKGROUND_RATIO));
+        lock_release(&cache_lock);
     }
 }
 
-void 
-read_ahead()
+/* Throttles a thread about to dirty a slot: if more than
+   DIRTY_THROTTLE_RATIO percent of the cache is dirty, the caller
+   writes back dirty slots itself until no more than
+   DIRTY_BACKGROUND_RATIO percent are.  Must be called with
+   cache_lock held. */
+static void
+cache_throttle (void)
+{
+    if (cache_dirty_cnt > cache_dirty_limit (DIRTY_THROTTLE_RATIO))
+        cache_flush_dirty (0, cache_dirty_limit (DIRTY_BACKGROUND_RATIO));
+}
+
+/* Read-ahead thread.  Brings each queued sector into the cache
+   without copying it anywhere, so that a later cache_read() of a
+   sequential stream hits. */
+static void
+read_ahead (void *aux UNUSED)
 {
     while(true){
-        cond_wait(&read_ahead_cond, &read_ahead_lock);
+        lock_acquire(&read_ahead_lock);
+        while (list_empty(&read_ahead_list))
+            cond_wait(&read_ahead_cond, &read_ahead_lock);
         struct read_ahead * read_ahead_unit = list_entry(list_pop_front(&read_ahead_list), struct read_ahead, elem);
-        cache_read(read_ahead_unit->block_to_read, read_ahead_unit->buffer);
+        read_ahead_cnt--;
+        lock_release(&read_ahead_lock);
+
+        cache_lock_acquire ();
+        if (search_sector (read_ahead_unit->block_to_read) == -1)
+            cache_get_slot (read_ahead_unit->block_to_read,
+                            CACHE_READ | CACHE_PREFETCH);
+        lock_release(&cache_lock);
+        free (read_ahead_unit);
     }
 }
 
+/* Queues SECTOR_ID to be prefetched into the cache by the
+   read-ahead thread and returns immediately.  The request is
+   dropped if the queue is full or memory is short. */
+void
+cache_read_ahead (block_sector_t sector_id)
+{
+    struct read_ahead *read_ahead_unit;
+
+    lock_acquire(&read_ahead_lock);
+    if (read_ahead_cnt < READ_AHEAD_QUEUE_MAX){
+        read_ahead_unit = malloc (sizeof *read_ahead_unit);
+        if (read_ahead_unit != NULL){
+            read_ahead_unit->block_to_read = sector_id;
+            list_push_back(&read_ahead_list, &read_ahead_unit->elem);
+            read_ahead_cnt++;
+            cond_signal(&read_ahead_cond, &read_ahead_lock);
+        }
+    }
+    lock_release(&read_ahead_lock);
+}
+
 void 
 cache_init ()
 {
@@ -33,135 +229,727 @@ cache_init ()
     lock_init(&read_ahead_lock);
     cond_init(&read_ahead_cond);
     list_init(&read_ahead_list);
-    clock_ptr = -1;
-    for (int i = 0; i < MAX_CACHE_SIZE; i++){
-        memset (cache[i].buffer, 0, BLOCK_SECTOR_SIZE);
+    read_ahead_cnt = 0;
+    if (!hash_init (&cache_index, cache_hash, cache_less, NULL))
+        PANIC ("buffer cache index creation failed");
+    clock_ptr = 0;
+    list_init (&twoq_a1in);
+    list_init (&twoq_am);
+    list_init (&twoq_a1out);
+    list_init (&twoq_ghost_free);
+    twoq_a1in_cnt = 0;
+
+    cache_slot_cnt = ROUND_UP (cache_max_sectors, CACHE_PAGE_SECTORS);
+    if (cache_slot_cnt < MIN_CACHE_SIZE)
+        cache_slot_cnt = MIN_CACHE_SIZE;
+    cache = calloc (cache_slot_cnt, sizeof *cache);
+    cache_pages = calloc (cache_slot_cnt / CACHE_PAGE_SECTORS, sizeof *cache_pages);
+    if (cache == NULL || cache_pages == NULL)
+        PANIC ("buffer cache allocation failed");
+    cache_page_cnt = 0;
+    cache_valid_cnt = 0;
+    cache_dirty_cnt = 0;
+    for (size_t i = 0; i < cache_slot_cnt; i++){
+        cache[i].buffer = NULL;
         cache[i].sector_id = 0;
         cache[i].dirty = false;
         cache[i].valid = false;
         cache[i].pin_bit = false;
+        cache[i].loading = false;
+        cache[i].flushing = false;
+        cache[i].ref_cnt = 0;
+        cache[i].meta = false;
+        cache[i].prefetched = false;
+        cache[i].queue = TWOQ_NONE;
+        cond_init (&cache[i].io_done);
     }
+    if (cache_policy == CACHE_POLICY_2Q){
+        size_t ghost_cnt = cache_slot_cnt * TWOQ_KOUT_RATIO / 100;
+        struct twoq_ghost *ghosts = calloc (ghost_cnt, sizeof *ghosts);
+        if (ghosts == NULL
+            || !hash_init (&twoq_ghost_index, twoq_ghost_hash, twoq_ghost_less, NULL))
+            PANIC ("buffer cache allocation failed");
+        for (size_t i = 0; i < ghost_cnt; i++)
+            list_push_back (&twoq_ghost_free, &ghosts[i].list_elem);
+    }
+    while (cache_page_cnt * CACHE_PAGE_SECTORS < MIN_CACHE_SIZE)
+        if (!cache_grow ())
+            PANIC ("buffer cache allocation failed");
+    palloc_set_reclaim (cache_reclaim);
 
     thread_create ("write_behind_t", PRI_DEFAULT, write_behind, NULL);
-    // thread_create ("read_ahead_t", PRI_DEFAULT, read_ahead, NULL);
+    thread_create ("read_ahead_t", PRI_DEFAULT, read_ahead, NULL);
 }
 
-void
-cache_read (block_sector_t sector_id, void *buffer)
+/* Returns a slot holding SECTOR_ID, loading it from disk on a
+   miss.  For CACHE_WRITE and CACHE_OVERWRITE the slot is also
+   waited on while it is being written back.  For CACHE_OVERWRITE
+   the caller is about to replace the whole sector, so a miss
+   skips the disk read and returns the slot still marked loading;
+   the caller must clear that once the buffer is filled.  A
+   CACHE_PREFETCH lookup is not a use of the sector: a hit leaves
+   the replacement state alone.  A miss leaves the slot's
+   second-chance bit clear, so that a prefetched sector that is
+   never read is the first to go.  Must be called with cache_lock
+   held; the lock is dropped around any disk I/O, so callers must
+   not rely on cache state observed before the call. */
+static int
+cache_get_slot (block_sector_t sector_id, enum cache_mode mode)
 {
-    lock_acquire(&cache_lock);
-    int slot = search_sector (sector_id);
+    enum cache_mode access = mode & ~(CACHE_META | CACHE_PREFETCH);
+    bool meta = (mode & CACHE_META) != 0;
+    bool prefetch = (mode & CACHE_PREFETCH) != 0;
+    int slot;
+
+ retry:
+    slot = search_sector (sector_id);
     if (slot != -1){
-        memcpy (buffer, cache[slot].buffer, BLOCK_SECTOR_SIZE);
-    }else {
-        int slot = clock_algorithm ();
-        cache[slot].sector_id = sector_id;
-        cache[slot].dirty == false;
-        cache[slot].valid = true;
-        cache[slot].pin_bit = true;
+        /* Wait for an in-flight fill, or for a write-back if we
+           are going to modify the buffer. */
+        if (cache[slot].loading || (access != CACHE_READ && cache[slot].flushing)){
+            cond_wait (&cache[slot].io_done, &cache_lock);
+            goto retry;
+        }
+        cache_trace (sector_id, mode, true);
+        if (!prefetch){
+            cache_stats.hits++;
+            if (cache[slot].prefetched){
+                cache[slot].prefetched = false;
+                cache_stats.prefetch_hits++;
+            }
+            cache_policy_touch (slot, meta);
+        }
+        return slot;
+    }
+
+    slot = cache_evict ();
 
+    /* cache_evict() may have dropped cache_lock to write back its
+       victim, so another thread may have cached SECTOR_ID in the
+       meantime.  The victim is simply left free. */
+    if (search_sector (sector_id) != -1)
+        goto retry;
+
+    cache[slot].sector_id = sector_id;
+    cache[slot].valid = true;
+    cache[slot].dirty = false;
+    hash_insert (&cache_index, &cache[slot].hash_elem);
+    cache_valid_cnt++;
+    cache_policy_insert (slot, meta);
+    cache[slot].prefetched = prefetch;
+    if (prefetch)
+        cache[slot].pin_bit = false;
+    cache_trace (sector_id, mode, false);
+    if (prefetch)
+        cache_stats.prefetches++;
+    else
+        cache_stats.misses++;
+
+    /* Other threads that miss on SECTOR_ID find the slot in the
+       index and wait on io_done until it has been filled. */
+    cache[slot].loading = true;
+    if (access != CACHE_OVERWRITE){
+        lock_release (&cache_lock);
         block_read (fs_device, sector_id, cache[slot].buffer);
-        memcpy (buffer, cache[slot].buffer, BLOCK_SECTOR_SIZE);
+        cache_lock_acquire ();
+        cache[slot].loading = false;
+        cond_broadcast (&cache[slot].io_done, &cache_lock);
     }
-    lock_release(&cache_lock);
+    return slot;
+}
+
+/* Writes back the CNT dirty slots in SLOTS, which must hold
+   consecutive sectors in ascending order, with cache_lock dropped.
+   While the write is in flight the slots are marked flushing:
+   readers may still copy out of them, but writers and evictors
+   wait.  Must be called with cache_lock held. */
+static void
+cache_flush_run (const int *slots, size_t cnt)
+{
+    struct block_iov iov[WRITE_BEHIND_RUN_MAX];
+    size_t i;
+
+    ASSERT (cnt <= WRITE_BEHIND_RUN_MAX);
+    for (i = 0; i < cnt; i++){
+        struct buffer_cache *b = &cache[slots[i]];
+        ASSERT (b->valid && b->dirty);
+        ASSERT (!b->loading && !b->flushing);
+        ASSERT (b->ref_cnt == 0);
+        ASSERT (i == 0 || b->sector_id == cache[slots[i - 1]].sector_id + 1);
+        b->flushing = true;
+    }
+    lock_release (&cache_lock);
+    /* The whole run goes out as one vectored write. */
+    for (i = 0; i < cnt; i++){
+        iov[i].buffer = cache[slots[i]].buffer;
+        iov[i].cnt = 1;
+    }
+    block_writev (fs_device, cache[slots[0]].sector_id, iov, cnt);
+    cache_lock_acquire ();
+    for (i = 0; i < cnt; i++){
+        struct buffer_cache *b = &cache[slots[i]];
+        b->flushing = false;
+        b->dirty = false;
+        cache_dirty_cnt--;
+        cond_broadcast (&b->io_done, &cache_lock);
+    }
+    cache_stats.write_backs += cnt;
+}
+
+/* Writes back dirty slot I.  See cache_flush_run(). */
+static void
+cache_flush_slot (int i)
+{
+    cache_flush_run (&i, 1);
+}
+
+/* Returns true if slot I can be written back right now. */
+static bool
+cache_flushable (int i)
+{
+    return (cache[i].valid && cache[i].dirty && !cache[i].loading
+            && !cache[i].flushing && cache[i].ref_cnt == 0);
+}
+
+/* Orders slot numbers by the sector they hold. */
+static int
+cache_compare_sectors (const void *a_, const void *b_)
+{
+    block_sector_t a = cache[*(const int *) a_].sector_id;
+    block_sector_t b = cache[*(const int *) b_].sector_id;
+    return a < b ? -1 : a > b;
+}
+
+/* Writes back dirty slots in ascending sector order without
+   invalidating them, until no more than TARGET slots are dirty.
+   Only slots that have been dirty for at least MIN_AGE ticks
+   start a write, but each write also takes along the dirty slots
+   holding the sectors right after it, up to WRITE_BEHIND_RUN_MAX
+   in all.  Slots that are busy or pinned are skipped.  Must be
+   called with cache_lock held; drops it during I/O. */
+static void
+cache_flush_dirty (int64_t min_age, size_t target)
+{
+    int *order, run[WRITE_BEHIND_RUN_MAX];
+    size_t order_cnt, i, j;
+
+    if (cache_dirty_cnt <= target)
+        return;
+
+    /* Snapshot the dirty slots and sort them by sector.  The
+       snapshot goes stale while cache_lock is dropped, so each
+       slot is checked again before it is written. */
+    order = malloc (cache_dirty_cnt * sizeof *order);
+    if (order == NULL){
+        /* Fall back to slot order, one sector at a time. */
+        for (i = 0; i < cache_slot_cnt && cache_dirty_cnt > target; i++)
+            if (cache_flushable (i)
+                && timer_elapsed (cache[i].dirty_since) >= min_age)
+                cache_flush_slot (i);
+        return;
+    }
+    order_cnt = 0;
+    for (i = 0; i < cache_slot_cnt; i++)
+        if (cache[i].valid && cache[i].dirty)
+            order[order_cnt++] = i;
+    qsort (order, order_cnt, sizeof *order, cache_compare_sectors);
+
+    for (i = 0; i < order_cnt && cache_dirty_cnt > target; i = j){
+        size_t run_cnt = 0;
+
+        j = i + 1;
+        if (!cache_flushable (order[i])
+            || timer_elapsed (cache[order[i]].dirty_since) < min_age)
+            continue;
+        run[run_cnt++] = order[i];
+        while (j < order_cnt && run_cnt < WRITE_BEHIND_RUN_MAX
+               && cache_flushable (order[j])
+               && cache[order[j]].sector_id == cache[run[run_cnt - 1]].sector_id + 1)
+            run[run_cnt++] = order[j++];
+        cache_flush_run (run, run_cnt);
+    }
+    free (order);
 }
 
 void
-cache_write (block_sector_t sector_id, void *buffer)
+cache_read (block_sector_t sector_id, void *buffer)
 {
-    lock_acquire(&cache_lock);
-    int slot = search_sector (sector_id);
-    if (slot != -1){
-        cache[slot].pin_bit = true;
+    cache_lock_acquire ();
+    int slot = cache_get_slot (sector_id, CACHE_READ);
+    memcpy (buffer, cache[slot].buffer, BLOCK_SECTOR_SIZE);
+    lock_release(&cache_lock);
+}
 
-        memcpy (cache[slot].buffer, buffer, BLOCK_SECTOR_SIZE);
-        cache[slot].dirty = true;
-    }else {
-        int slot = clock_algorithm ();
+void
+cache_write (block_sector_t sector_id, const void *buffer)
+{
+    cache_lock_acquire ();
+    cache_throttle ();
+    int slot = cache_get_slot (sector_id, CACHE_OVERWRITE);
+    memcpy (cache[slot].buffer, buffer, BLOCK_SECTOR_SIZE);
+    cache_mark_dirty (&cache[slot]);
+    cache[slot].loading = false;
+    lock_release(&cache_lock);
+}
 
-        cache[slot].sector_id = sector_id;
-        cache[slot].valid = true;
-        cache[slot].dirty = true;
-        cache[slot].pin_bit = true;
+/* Pins the slot holding SECTOR_ID and returns it, so that the
+   caller can use its buffer in place until cache_put().
+   CACHE_READ and CACHE_WRITE load the sector on a miss;
+   CACHE_OVERWRITE does not, and the caller must fill all of the
+   buffer before releasing it.  A pinned slot is never evicted,
+   written back or given back to palloc.  Callers should keep
+   slots pinned only briefly and must not pin the same sector
+   twice for CACHE_OVERWRITE. */
+struct buffer_cache *
+cache_get (block_sector_t sector_id, enum cache_mode mode)
+{
+    cache_lock_acquire ();
+    if ((mode & ~CACHE_META) != CACHE_READ)
+        cache_throttle ();
+    int slot = cache_get_slot (sector_id, mode);
+    cache[slot].ref_cnt++;
+    lock_release(&cache_lock);
+    return &cache[slot];
+}
 
-        /* Write back is in clock algorithm */
-        memcpy (cache[slot].buffer, buffer, BLOCK_SECTOR_SIZE);
+/* Releases slot B pinned by cache_get(), marking it dirty if
+   DIRTY is true. */
+void
+cache_put (struct buffer_cache *b, bool dirty)
+{
+    cache_lock_acquire ();
+    ASSERT (b->ref_cnt > 0);
+    if (dirty)
+        cache_mark_dirty (b);
+    /* Only a CACHE_OVERWRITE miss leaves a pinned slot loading. */
+    if (b->loading){
+        b->loading = false;
+        cond_broadcast (&b->io_done, &cache_lock);
     }
+    if (--b->ref_cnt == 0)
+        cond_broadcast (&b->io_done, &cache_lock);
     lock_release(&cache_lock);
-    block_write (fs_device, sector_id, buffer);
 }
 
 
+/* Returns the slot holding SECTOR_ID, or -1 if it is not cached.
+   Must be called with cache_lock held. */
 int search_sector (block_sector_t sector_id)
 {
-    for (int i = 0; i < MAX_CACHE_SIZE; i++)
-        if (cache[i].valid && cache[i].sector_id == sector_id) return i;
-        
-    return -1;
+    struct buffer_cache key;
+    struct hash_elem *e;
+
+    key.sector_id = sector_id;
+    e = hash_find (&cache_index, &key.hash_elem);
+    if (e == NULL)
+        return -1;
+    return hash_entry (e, struct buffer_cache, hash_elem) - cache;
+}
+
+/* Acquires cache_lock, accounting for any time spent waiting.
+   A cond_wait() on cache_lock reacquires it with plain
+   lock_acquire(), so contention met on the way out of one is not
+   counted. */
+static void
+cache_lock_acquire (void)
+{
+    if (!lock_try_acquire (&cache_lock)){
+        int64_t start = timer_ticks ();
+        lock_acquire (&cache_lock);
+        cache_stats.lock_waits++;
+        cache_stats.lock_wait_ticks += timer_elapsed (start);
+    }
+}
+
+/* Writes back VICTIM if it is dirty and frees it.  Returns false,
+   leaving VICTIM cached, if a reader pinned it while it was being
+   written back.  Must be called with cache_lock held. */
+static bool
+cache_evict_victim (int victim)
+{
+    if (cache[victim].dirty){
+        /* Nobody can dirty the slot again while it is flushing,
+           so it is clean once this returns. */
+        cache_flush_slot (victim);
+        if (cache[victim].ref_cnt > 0)
+            return false;
+    }
+    cache_invalidate (victim);
+    cache_stats.evictions++;
+    return true;
 }
 
+/* Picks a slot to (re)use under the configured replacement
+   policy and returns it free.  If every slot that has a page is
+   in use, first tries to grow the cache by a page.  A dirty
+   victim is written back first, with cache_lock dropped for the
+   transfer.  Must be called with cache_lock held. */
+static int
+cache_evict (void)
+{
+    if (cache_valid_cnt == cache_page_cnt * CACHE_PAGE_SECTORS)
+        cache_grow ();
+    return cache_policy == CACHE_POLICY_2Q ? twoq_evict () : clock_algorithm ();
+}
+
+/* Returns true if slot I has no I/O in flight and is not pinned. */
+static bool
+cache_idle (int i)
+{
+    return !cache[i].loading && !cache[i].flushing && cache[i].ref_cnt == 0;
+}
+
+/* Second-chance clock.  Slots with I/O in flight or pinned are
+   skipped; if every slot is busy we sleep until the one under the
+   clock hand finishes. */
 int clock_algorithm ()
 {
+    size_t busy_cnt = 0;
+
     // clock
     while (true){
+        /* Slots without a page are not part of the cache. */
+        if (cache[clock_ptr].buffer == NULL){
+            clock_ptr_move();
+            continue;
+        }
         /* We first check whether there are cache block that is marked free and if so we directly release that cache block*/
         if (!cache[clock_ptr].valid){
             int ret = clock_ptr;
             clock_ptr_move();
             return ret;
         }
+        /* Slots being filled, written back or used in place by
+           cache_get() callers are not candidates. */
+        if (!cache_idle (clock_ptr)){
+            if (++busy_cnt >= cache_page_cnt * CACHE_PAGE_SECTORS){
+                cond_wait (&cache[clock_ptr].io_done, &cache_lock);
+                busy_cnt = 0;
+            }else
+                clock_ptr_move();
+            continue;
+        }
+        busy_cnt = 0;
         /* We pick the one that doesn't have a second chance */
         if (!cache[clock_ptr].pin_bit){
-            if (cache[clock_ptr].dirty) block_write(fs_device, cache[clock_ptr].sector_id, cache[clock_ptr].buffer);
-            cache[clock_ptr].valid = false;
             int ret = clock_ptr;
             clock_ptr_move();
-            return ret;
+            if (cache_evict_victim (ret))
+                return ret;
+            continue;
         }
 
         cache[clock_ptr].pin_bit = false;
         clock_ptr_move();
     }
+}
+
+/* Hashes a ghost by its sector number. */
+static unsigned
+twoq_ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+    return hash_int (hash_entry (e, struct twoq_ghost, hash_elem)->sector_id);
+}
 
+/* Orders two ghosts by sector number. */
+static bool
+twoq_ghost_less (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+    return hash_entry (a, struct twoq_ghost, hash_elem)->sector_id
+           < hash_entry (b, struct twoq_ghost, hash_elem)->sector_id;
+}
 
-    // LRU to fix
-    // int ret = -1;
-    // remake:
-    // for(int i = 0; i < 64; i++){
-    //     if(cache[i].used) continue;
-    //     int minimum = 0x3f3f3f3f;
-    //     if(cache[i].accessed < minimum){
-    //         if(cache[i].pin_bit){
-    //             cache[i].pin_bit = false;
-    //             continue;
-    //         }
-    //         minimum = cache[i].pin_bit;
-    //         ret = i;
-    //     }
-    // }
+/* Remembers SECTOR_ID on A1out, forgetting the oldest ghost if
+   A1out is full. */
+static void
+twoq_ghost_add (block_sector_t sector_id)
+{
+    struct twoq_ghost *g;
 
-    // if(ret == -1) goto remake;
-    // if(cache[ret].dirty) block_write (fs_device, cache[ret].sector_id, cache[ret].buffer);
-    // return ret;
+    if (!list_empty (&twoq_ghost_free))
+        g = list_entry (list_pop_front (&twoq_ghost_free), struct twoq_ghost, list_elem);
+    else if (!list_empty (&twoq_a1out)){
+        g = list_entry (list_pop_back (&twoq_a1out), struct twoq_ghost, list_elem);
+        hash_delete (&twoq_ghost_index, &g->hash_elem);
+    }else
+        return;
+    g->sector_id = sector_id;
+    hash_insert (&twoq_ghost_index, &g->hash_elem);
+    list_push_front (&twoq_a1out, &g->list_elem);
 }
 
-int
-clock_ptr_move()
+/* Forgets SECTOR_ID if it is on A1out.  Returns true if it was. */
+static bool
+twoq_ghost_take (block_sector_t sector_id)
 {
-    clock_ptr = (clock_ptr + 1) % MAX_CACHE_SIZE;
-    return;
+    struct twoq_ghost key;
+    struct hash_elem *e;
+    struct twoq_ghost *g;
+
+    key.sector_id = sector_id;
+    e = hash_delete (&twoq_ghost_index, &key.hash_elem);
+    if (e == NULL)
+        return false;
+    g = hash_entry (e, struct twoq_ghost, hash_elem);
+    list_remove (&g->list_elem);
+    list_push_front (&twoq_ghost_free, &g->list_elem);
+    return true;
 }
 
+/* Returns the least recently queued idle slot on Q, skipping
+   metadata slots if SKIP_META, or -1 if there is none. */
+static int
+twoq_oldest (struct list *q, bool skip_meta)
+{
+    struct list_elem *e;
 
-void cache_out_all ()
+    for (e = list_rbegin (q); e != list_rend (q); e = list_prev (e)){
+        struct buffer_cache *b = list_entry (e, struct buffer_cache, queue_elem);
+        if (cache_idle (b - cache) && !(skip_meta && b->meta))
+            return b - cache;
+    }
+    return -1;
+}
+
+/* Simplified full 2Q [Johnson and Shasha, VLDB 1994].  A sector
+   referenced for the first time goes to the A1in FIFO.  When it
+   is evicted from A1in its number is remembered on the A1out
+   ghost queue, and if it misses again while still remembered it
+   goes to the Am LRU list instead.  Metadata sectors go to Am
+   straight away.  Victims come from A1in while A1in holds more
+   than TWOQ_KIN_RATIO percent of the cache, and otherwise from
+   the least recently used non-metadata slot on Am, so that a
+   single large scan only churns A1in and the metadata working
+   set survives it. */
+static int
+twoq_evict (void)
 {
-    lock_acquire(&cache_lock);
-    for (int i = 0; i < MAX_CACHE_SIZE; i++) {
-        if (cache[i].valid && cache[i].dirty){
-            block_write (fs_device, cache[i].sector_id, cache[i].buffer);
-            cache[i].valid = false;
-            cache[i].dirty = false;
+    while (true){
+        size_t page_slots = cache_page_cnt * CACHE_PAGE_SECTORS;
+        int victim = -1;
+
+        if (cache_valid_cnt < page_slots){
+            for (size_t i = 0; i < cache_slot_cnt; i++)
+                if (cache[i].buffer != NULL && !cache[i].valid)
+                    return i;
+        }
+
+        if (twoq_a1in_cnt > page_slots * TWOQ_KIN_RATIO / 100)
+            victim = twoq_oldest (&twoq_a1in, false);
+        if (victim == -1)
+            victim = twoq_oldest (&twoq_am, true);
+        if (victim == -1)
+            victim = twoq_oldest (&twoq_a1in, false);
+        if (victim == -1)
+            victim = twoq_oldest (&twoq_am, false);
+        if (victim == -1){
+            /* Every slot is busy.  Wait for the oldest one. */
+            struct list *q = !list_empty (&twoq_a1in) ? &twoq_a1in : &twoq_am;
+            cond_wait (&list_entry (list_back (q), struct buffer_cache, queue_elem)->io_done,
+                       &cache_lock);
+            continue;
         }
+
+        bool from_a1in = cache[victim].queue == TWOQ_A1IN;
+        block_sector_t sector_id = cache[victim].sector_id;
+        if (!cache_evict_victim (victim))
+            continue;
+        if (from_a1in)
+            twoq_ghost_add (sector_id);
+        return victim;
+    }
+}
+
+/* Records a hit on slot I.  META marks it as holding metadata. */
+static void
+cache_policy_touch (int i, bool meta)
+{
+    cache[i].pin_bit = true;
+    if (meta)
+        cache[i].meta = true;
+    if (cache[i].queue == TWOQ_AM){
+        list_remove (&cache[i].queue_elem);
+        list_push_front (&twoq_am, &cache[i].queue_elem);
+    }else if (cache[i].queue == TWOQ_A1IN && cache[i].meta){
+        list_remove (&cache[i].queue_elem);
+        twoq_a1in_cnt--;
+        cache[i].queue = TWOQ_AM;
+        list_push_front (&twoq_am, &cache[i].queue_elem);
+    }
+}
+
+/* Records that slot I now holds a newly cached sector.  META
+   marks it as holding metadata. */
+static void
+cache_policy_insert (int i, bool meta)
+{
+    cache[i].pin_bit = true;
+    cache[i].meta = meta;
+    if (cache_policy != CACHE_POLICY_2Q)
+        return;
+    if (twoq_ghost_take (cache[i].sector_id) || meta){
+        cache[i].queue = TWOQ_AM;
+        list_push_front (&twoq_am, &cache[i].queue_elem);
+    }else{
+        cache[i].queue = TWOQ_A1IN;
+        list_push_front (&twoq_a1in, &cache[i].queue_elem);
+        twoq_a1in_cnt++;
+    }
+}
+
+/* Takes slot I off its 2Q queue, if any. */
+static void
+cache_policy_remove (int i)
+{
+    if (cache[i].queue == TWOQ_A1IN)
+        twoq_a1in_cnt--;
+    if (cache[i].queue != TWOQ_NONE)
+        list_remove (&cache[i].queue_elem);
+    cache[i].queue = TWOQ_NONE;
+}
+
+/* Selects the replacement policy NAME, "clock" or "2q".  Must be
+   called before cache_init().  Returns false if NAME is not a
+   known policy. */
+bool
+cache_set_policy (const char *name)
+{
+    if (name != NULL && !strcmp (name, "clock"))
+        cache_policy = CACHE_POLICY_CLOCK;
+    else if (name != NULL && !strcmp (name, "2q"))
+        cache_policy = CACHE_POLICY_2Q;
+    else
+        return false;
+    return true;
+}
+
+static void
+clock_ptr_move (void)
+{
+    clock_ptr = (clock_ptr + 1) % cache_slot_cnt;
+}
+
+/* Gives the cache one more page worth of free slots, if it is
+   below cache_max_sectors and palloc can spare a page.  Returns
+   true if successful.  Must be called with cache_lock held, or
+   during initialization. */
+static bool
+cache_grow (void)
+{
+    size_t page_idx;
+    uint8_t *page;
+
+    for (page_idx = 0; page_idx < cache_slot_cnt / CACHE_PAGE_SECTORS; page_idx++)
+        if (cache_pages[page_idx] == NULL)
+            break;
+    if (page_idx == cache_slot_cnt / CACHE_PAGE_SECTORS)
+        return false;
+
+    /* Our own cache_reclaim() bails out because we hold
+       cache_lock, so this cannot recurse. */
+    page = palloc_get_page (0);
+    if (page == NULL)
+        return false;
+
+    cache_pages[page_idx] = page;
+    cache_page_cnt++;
+    for (size_t i = 0; i < CACHE_PAGE_SECTORS; i++){
+        struct buffer_cache *b = &cache[page_idx * CACHE_PAGE_SECTORS + i];
+        b->buffer = page + i * BLOCK_SECTOR_SIZE;
+        b->valid = false;
+    }
+    return true;
+}
+
+/* Reclaimer registered with palloc.  Frees the highest page of
+   the cache whose slots are all clean and idle, dropping the
+   sectors they hold.  Returns false without blocking if
+   cache_lock is not immediately available, if the cache is
+   already at MIN_CACHE_SIZE, or if no page can be freed without
+   disk I/O. */
+static bool
+cache_reclaim (void)
+{
+    bool success = false;
+
+    if (lock_held_by_current_thread (&cache_lock)
+        || !lock_try_acquire (&cache_lock))
+        return false;
+
+    for (size_t page_idx = cache_slot_cnt / CACHE_PAGE_SECTORS; page_idx-- > 0; ){
+        struct buffer_cache *first = &cache[page_idx * CACHE_PAGE_SECTORS];
+        size_t i;
+
+        if ((cache_page_cnt - 1) * CACHE_PAGE_SECTORS < MIN_CACHE_SIZE)
+            break;
+        if (cache_pages[page_idx] == NULL)
+            continue;
+        for (i = 0; i < CACHE_PAGE_SECTORS; i++)
+            if (first[i].loading || first[i].flushing || first[i].dirty
+                || first[i].ref_cnt > 0)
+                break;
+        if (i < CACHE_PAGE_SECTORS)
+            continue;
+
+        for (i = 0; i < CACHE_PAGE_SECTORS; i++){
+            if (first[i].valid)
+                cache_invalidate (first - cache + i);
+            first[i].buffer = NULL;
+        }
+        palloc_free_page (cache_pages[page_idx]);
+        cache_pages[page_idx] = NULL;
+        cache_page_cnt--;
+        success = true;
+        break;
+    }
+
+    lock_release (&cache_lock);
+    return success;
+}
+
+
+/* Writes every dirty slot back to disk, keeping the data cached,
+   and waits for write-backs started by other threads.  Called at
+   shutdown by filesys_done(). */
+void cache_out_all ()
+{
+    cache_lock_acquire ();
+    cache_flush_dirty (0, 0);
+    for (size_t i = 0; i < cache_slot_cnt; i++) {
+        /* Slots being written back by someone else, or pinned
+           slots that may be mid-update, get another chance. */
+        while (cache[i].flushing || (cache[i].dirty && cache[i].ref_cnt > 0))
+            cond_wait (&cache[i].io_done, &cache_lock);
+        if (cache_flushable (i))
+            cache_flush_slot (i);
     }
     lock_release(&cache_lock);
 }
+
+/* Copies the cache's statistics into STATS. */
+void
+cache_get_stats (struct cache_stats *stats)
+{
+    cache_lock_acquire ();
+    *stats = cache_stats;
+    stats->sectors = cache_page_cnt * CACHE_PAGE_SECTORS;
+    stats->dirty = cache_dirty_cnt;
+    lock_release (&cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+    struct cache_stats s;
+
+    cache_get_stats (&s);
+    printf ("Cache: %zu sectors (%s), %llu hits, %llu misses, %llu evictions, "
+            "%llu write-backs\n",
+            s.sectors, cache_policy == CACHE_POLICY_2Q ? "2q" : "clock",
+            s.hits, s.misses, s.evictions, s.write_backs);
+    printf ("Cache: %llu prefetched, %llu used, %llu wasted; "
+            "%llu lock waits, %lld ticks\n",
+            s.prefetches, s.prefetch_hits, s.prefetch_wasted,
+            s.lock_waits, s.lock_wait_ticks);
+}
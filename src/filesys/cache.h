@@ -10,34 +10,121 @@
 #include "threads/thread.h"
 #include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/vaddr.h"
+#include <hash.h>
 
-#define MAX_CACHE_SIZE 64
+/* Cache slots are backed by kernel pages, CACHE_PAGE_SECTORS
+   slots to a page.  The cache starts out with MIN_CACHE_SIZE
+   slots, grows on demand up to cache_max_sectors, and gives pages
+   back to palloc under memory pressure, but never below
+   MIN_CACHE_SIZE. */
+#define CACHE_PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+#define MIN_CACHE_SIZE CACHE_PAGE_SECTORS
+#define MAX_CACHE_SIZE 64               /* Default for cache_max_sectors. */
 
-/* For read ahead */
-struct condition read_ahead_cond;
-struct lock read_ahead_lock;
-struct list read_ahead_list;
+/* Largest -cache value accepted, 32 MB of cache. */
+#define CACHE_SECTORS_LIMIT 65536
+
+/* -cache: Maximum number of sectors in the buffer cache. */
+extern size_t cache_max_sectors;
+
+/* Replacement policies, selected with -cache-policy. */
+enum cache_policy
+  {
+    CACHE_POLICY_CLOCK,             /* Second-chance clock. */
+    CACHE_POLICY_2Q                 /* Scan-resistant 2Q. */
+  };
+extern enum cache_policy cache_policy;
+
+/* 2Q tuning.  See the comment above twoq_evict() in cache.c. */
+#define TWOQ_KIN_RATIO 25               /* A1in share of the cache, in %. */
+#define TWOQ_KOUT_RATIO 50              /* A1out ghosts, in % of max size. */
+
+/* 2Q queue a slot is on. */
+enum twoq_queue
+  {
+    TWOQ_NONE,                      /* Not on a queue (free, or clock). */
+    TWOQ_A1IN,                      /* Referenced once, FIFO. */
+    TWOQ_AM                         /* Referenced again or metadata, LRU. */
+  };
+
+/* Buffer cache statistics, since boot. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups that found the sector. */
+    unsigned long long misses;          /* Lookups that had to load it. */
+    unsigned long long evictions;       /* Slots reused for another sector. */
+    unsigned long long write_backs;     /* Dirty sectors written to disk. */
+    unsigned long long prefetches;      /* Sectors loaded by read-ahead. */
+    unsigned long long prefetch_hits;   /* ...later used. */
+    unsigned long long prefetch_wasted; /* ...dropped without being used. */
+    unsigned long long lock_waits;      /* Contended cache_lock acquires,
+                                           not counting reacquires
+                                           in cond_wait(). */
+    int64_t lock_wait_ticks;            /* Timer ticks spent in those. */
+    size_t sectors;                     /* Slots currently backed by pages. */
+    size_t dirty;                       /* Slots currently dirty. */
+  };
+
+/* Write-behind tuning.  See the comment at the top of cache.c. */
+#define WRITE_BEHIND_TICKS 100          /* Write-behind wakeup period. */
+#define DIRTY_EXPIRE_TICKS 1000         /* Age at which a dirty slot is written. */
+#define DIRTY_BACKGROUND_RATIO 25       /* % dirty that triggers early write-back. */
+#define DIRTY_THROTTLE_RATIO 50         /* % dirty at which writers must help. */
+#define WRITE_BEHIND_RUN_MAX 32         /* Most sectors written back together. */
+
+/* Most sectors waiting in the read-ahead queue at once; further
+   requests are dropped until the read-ahead thread catches up. */
+#define READ_AHEAD_QUEUE_MAX 64
 
 struct buffer_cache
 {
-    unsigned char buffer[BLOCK_SECTOR_SIZE];
+    unsigned char *buffer;          /* Null if the slot has no page. */
     block_sector_t sector_id;
     bool dirty;
     bool pin_bit;
     bool valid;
+    bool loading;                   /* Being filled from disk. */
+    bool flushing;                  /* Being written back to disk. */
+    int ref_cnt;                    /* Number of cache_get() pins. */
+    int64_t dirty_since;            /* timer_ticks() when it became dirty. */
+    bool meta;                      /* Holds file system metadata. */
+    bool prefetched;                /* Read ahead and not yet used. */
+    enum twoq_queue queue;          /* 2Q queue, if any. */
+    struct list_elem queue_elem;    /* Element in that queue. */
+    struct condition io_done;       /* Signaled when loading or flushing ends. */
+    struct hash_elem hash_elem;     /* Element in the sector index. */
 };
 
+/* How cache_get() callers will use a slot's buffer.  CACHE_META
+   may be OR'd in to mark the sector as file system metadata
+   (inodes, indirect tables, directories), which replacement
+   policies try to keep cached. */
+enum cache_mode
+  {
+    CACHE_READ = 0,                 /* Read only. */
+    CACHE_WRITE = 1,                /* Read and modify in place. */
+    CACHE_OVERWRITE = 2,            /* Replace every byte; no disk read. */
+    CACHE_META = 4                  /* Sector holds metadata. */
+  };
+
+/* A sector queued for the read-ahead thread. */
 struct read_ahead
 {
     block_sector_t block_to_read;
-    void * buffer;
     struct list_elem elem;
 };
 
 void cache_init ();
+bool cache_set_policy (const char *name);
 void cache_read (block_sector_t sector_id, void *buffer);
-void cache_write (block_sector_t sector_id, void *buffer);
+void cache_write (block_sector_t sector_id, const void *buffer);
+struct buffer_cache *cache_get (block_sector_t sector_id, enum cache_mode);
+void cache_put (struct buffer_cache *, bool dirty);
 void cache_out_all ();
+void cache_get_stats (struct cache_stats *);
+void cache_print_stats (void);
+void cache_read_ahead (block_sector_t sector_id);
 int search_sector (block_sector_t sector_id);
 int clock_algorithm ();
 
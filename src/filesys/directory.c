@@ -98,32 +98,121 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* A position in a directory's entries, for reading or modifying
+   them in place in the buffer cache.  The sector holding the
+   current entry stays pinned in B until the cursor moves to
+   another sector or is closed.  An entry that straddles two
+   sectors is copied into COPY with inode_read_at() instead. */
+struct entry_cursor
+  {
+    struct inode *inode;                /* Directory's inode. */
+    enum cache_mode mode;               /* CACHE_READ or CACHE_WRITE. */
+    struct buffer_cache *b;             /* Pinned sector, if any. */
+    off_t b_ofs;                        /* Byte offset of B's sector. */
+    bool dirty;                         /* B modified? */
+    off_t ofs;                          /* Offset of current entry. */
+    struct dir_entry copy;              /* Current entry, if straddling. */
+  };
+
+/* Initializes C for access to INODE's entries in MODE. */
+static void
+cursor_init (struct entry_cursor *c, struct inode *inode,
+             enum cache_mode mode)
+{
+  c->inode = inode;
+  c->mode = mode;
+  c->b = NULL;
+  c->dirty = false;
+}
+
+/* Releases C's pinned sector, if any. */
+static void
+cursor_close (struct entry_cursor *c)
+{
+  if (c->b != NULL)
+    cache_put (c->b, c->dirty);
+  c->b = NULL;
+  c->dirty = false;
+}
+
+/* Returns the entry at byte offset OFS in C's directory, or a
+   null pointer if there is no whole entry there.  The entry may
+   be changed in place if C is in CACHE_WRITE mode, followed by a
+   call to cursor_modified(). */
+static struct dir_entry *
+cursor_get (struct entry_cursor *c, off_t ofs)
+{
+  off_t sector_ofs = ofs % BLOCK_SECTOR_SIZE;
+
+  if (ofs + (off_t) sizeof c->copy > inode_length (c->inode))
+    return NULL;
+  c->ofs = ofs;
+  if (sector_ofs + sizeof c->copy <= BLOCK_SECTOR_SIZE)
+    {
+      if (c->b == NULL || c->b_ofs != ofs - sector_ofs)
+        {
+          cursor_close (c);
+          c->b_ofs = ofs - sector_ofs;
+          c->b = inode_get_sector (c->inode, c->b_ofs, c->mode | CACHE_META);
+        }
+      return (struct dir_entry *) (c->b->buffer + sector_ofs);
+    }
+  else if (inode_read_at (c->inode, &c->copy, sizeof c->copy, ofs)
+           == sizeof c->copy)
+    return &c->copy;
+  else
+    return NULL;
+}
+
+/* Records that the entry last returned by cursor_get() for C
+   has been changed.  Returns true if successful, false if a
+   straddling entry could not be written back. */
+static bool
+cursor_modified (struct entry_cursor *c)
+{
+  if (c->ofs % BLOCK_SECTOR_SIZE + sizeof c->copy <= BLOCK_SECTOR_SIZE)
+    {
+      c->dirty = true;
+      return true;
+    }
+  return (inode_write_at (c->inode, &c->copy, sizeof c->copy, c->ofs)
+          == sizeof c->copy);
+}
+
+/* Searches C's directory for an entry in use with the given NAME.
+   Returns the entry, as cursor_get() does, if there is one, or a
+   null pointer otherwise. */
+static struct dir_entry *
+find_entry (struct entry_cursor *c, const char *name)
+{
+  struct dir_entry *p;
+  off_t ofs;
+
+  for (ofs = 0; (p = cursor_get (c, ofs)) != NULL; ofs += sizeof *p)
+    if (p->in_use && !strcmp (name, p->name))
+      return p;
+  return NULL;
+}
+
 /* Searches DIR for a file with the given NAME.
-   If successful, returns true, sets *EP to the directory entry
-   if EP is non-null, and sets *OFSP to the byte offset of the
-   directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   If successful, returns true and sets *EP to the directory entry
+   if EP is non-null.
+   otherwise, returns false and ignores EP. */
 static bool
-lookup (const struct dir *dir, const char *name,
-        struct dir_entry *ep, off_t *ofsp) 
+lookup (const struct dir *dir, const char *name, struct dir_entry *ep)
 {
-  struct dir_entry e;
-  size_t ofs;
-  
+  struct entry_cursor c;
+  struct dir_entry *p;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  cursor_init (&c, dir->inode, CACHE_READ);
+  p = find_entry (&c, name);
+  if (p != NULL && ep != NULL)
+    *ep = *p;
+  cursor_close (&c);
+  return p != NULL;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -139,7 +228,7 @@ dir_lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
+  if (lookup (dir, name, &e))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
@@ -156,7 +245,8 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
-  struct dir_entry e;
+  struct entry_cursor c;
+  struct dir_entry e, *p;
   off_t ofs;
   bool success = false;
 
@@ -168,26 +258,25 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  if (lookup (dir, name, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
+  /* Fill in the first free slot in place.  If there are no free
+     slots, append the entry at end of file instead. */
+  cursor_init (&c, dir->inode, CACHE_WRITE);
+  for (ofs = 0; (p = cursor_get (&c, ofs)) != NULL; ofs += sizeof *p)
+    if (!p->in_use)
       break;
-
-  /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (p == NULL)
+    p = &e;
+  p->in_use = true;
+  strlcpy (p->name, name, sizeof p->name);
+  p->inode_sector = inode_sector;
+  if (p != &e)
+    success = cursor_modified (&c);
+  cursor_close (&c);
+  if (p == &e)
+    success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
   if (name[0] == '.') return success;
   if (success){
@@ -198,15 +287,16 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
           return success;
       }
           
-      struct dir * directory = dir_open (inode);
-      /* Find the last level dir */
-      struct dir_entry ep;
-      off_t ofsp;
-      lookup (directory, "..", &ep, &ofsp);
-
-      ep.inode_sector = dir->inode->sector;
-      inode_write_at (directory->inode, &ep, sizeof (ep), ofsp);
-      dir_close (directory);
+      /* Point the new directory's ".." at DIR. */
+      cursor_init (&c, inode, CACHE_WRITE);
+      p = find_entry (&c, "..");
+      if (p != NULL)
+        {
+          p->inode_sector = dir->inode->sector;
+          cursor_modified (&c);
+        }
+      cursor_close (&c);
+      inode_close (inode);
     }
  done:
   return success;
@@ -218,26 +308,28 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
-  struct dir_entry e;
+  struct entry_cursor c;
+  struct dir_entry *p;
   struct inode *inode = NULL;
   bool success = false;
-  off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
   /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
+  cursor_init (&c, dir->inode, CACHE_WRITE);
+  p = find_entry (&c, name);
+  if (p == NULL)
     goto done;
 
   /* Open inode. */
-  inode = inode_open (e.inode_sector);
+  inode = inode_open (p->inode_sector);
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
-  e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+  /* Erase directory entry in place. */
+  p->in_use = false;
+  if (!cursor_modified (&c))
     goto done;
 
   /* Remove inode. */
@@ -245,6 +337,7 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  cursor_close (&c);
   inode_close (inode);
   return success;
 }
@@ -255,18 +348,22 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
+  struct entry_cursor c;
+  struct dir_entry *p;
+  bool found = false;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  cursor_init (&c, dir->inode, CACHE_READ);
+  while (!found && (p = cursor_get (&c, dir->pos)) != NULL)
     {
-      dir->pos += sizeof e;
-      if (e.in_use)
+      dir->pos += sizeof *p;
+      if (p->in_use)
         {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        } 
+          strlcpy (name, p->name, NAME_MAX + 1);
+          found = true;
+        }
     }
-  return false;
+  cursor_close (&c);
+  return found;
 }
 
 bool 
@@ -322,16 +419,18 @@ dir_split (char *name, struct dir *cur_dir, struct dir **ret_dir, char **ret_nam
 bool 
 dir_empty (struct dir *dir)
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct entry_cursor c;
+  struct dir_entry *p;
+  off_t ofs;
   
   ASSERT (dir != NULL);
   int count = 0;
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use) 
+  cursor_init (&c, dir->inode, CACHE_READ);
+  for (ofs = 0; (p = cursor_get (&c, ofs)) != NULL; ofs += sizeof *p)
+    if (p->in_use) 
       {
         count++;
       }
+  cursor_close (&c);
   return count == 2;
 }
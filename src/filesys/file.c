@@ -3,6 +3,14 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include <stdio.h>
+#include "devices/block.h"
+
+/* Read-ahead window bounds, in sectors.  The window starts at
+   READ_AHEAD_MIN when a file is first read sequentially, doubles
+   on each further sequential read up to READ_AHEAD_MAX, and
+   closes again on any non-sequential read. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 32
 
 /* An open file. */
 struct file 
@@ -10,8 +18,13 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Offset just past the last read. */
+    off_t ra_end;               /* End of the range already prefetched. */
+    size_t ra_window;           /* Read-ahead window, 0 if not sequential. */
   };
 
+static void file_read_ahead (struct file *, off_t offset, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -24,6 +37,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -70,6 +86,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  file_read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -82,7 +99,43 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  file_read_ahead (file, file_ofs, bytes_read);
+  return bytes_read;
+}
+
+/* Updates FILE's access pattern after a read of SIZE bytes at
+   OFFSET.  If FILE is being read sequentially, widens its
+   read-ahead window and queues the part of the window past what
+   has already been prefetched. */
+static void
+file_read_ahead (struct file *file, off_t offset, off_t size)
+{
+  off_t start, end;
+
+  if (size <= 0)
+    return;
+
+  if (offset == file->ra_next)
+    file->ra_window = (file->ra_window == 0 ? READ_AHEAD_MIN
+                       : file->ra_window * 2 < READ_AHEAD_MAX
+                       ? file->ra_window * 2 : READ_AHEAD_MAX);
+  else
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  file->ra_next = offset + size;
+  if (file->ra_window == 0)
+    return;
+
+  start = file->ra_end > file->ra_next ? file->ra_end : file->ra_next;
+  end = file->ra_next + (off_t) file->ra_window * BLOCK_SECTOR_SIZE;
+  if (start < end)
+    {
+      inode_read_ahead (file->inode, start, end - start);
+      file->ra_end = end;
+    }
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -4,6 +4,7 @@
 #include <string.h>
 #include "filesys/file.h"
 #include "filesys/free-map.h"
+#include "filesys/fsutil.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "threads/thread.h"
@@ -21,12 +22,12 @@ static void do_format (void);
 void
 filesys_init (bool format) 
 {
+  inode_init ();
   cache_init();
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
-  inode_init ();
   free_map_init ();
 
   if (format) 
@@ -40,8 +41,11 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
-  cache_out_all();
+  inode_flush_all ();
   free_map_close ();
+  cache_out_all();
+  fsutil_append_trace ();
+  cache_print_stats ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -64,7 +68,7 @@ filesys_create (const char *name, off_t initial_size)
   bool success = 0;
   if (dir_split (name, current_dir, &return_dir, &return_name) ){
     if(!dir_lookup (return_dir, return_name, &inode)){
-      success = (return_dir != NULL&& free_map_allocate (1, &inode_sector)&& inode_create (inode_sector, initial_size)&& dir_add (return_dir, return_name, inode_sector));
+      success = (return_dir != NULL&& free_map_allocate_inode (inode_get_inumber (dir_get_inode (return_dir)), false, &inode_sector)&& inode_create (inode_sector, initial_size)&& dir_add (return_dir, return_name, inode_sector));
       dir_close (return_dir);
       free (return_name);
       return success; 
@@ -185,7 +189,7 @@ filesys_mkdir (const char *name)
   block_sector_t sector;
   bool success=0;
   if (dir_split (name, cur_dir, &ret_dir, &ret_name) &&!dir_lookup (ret_dir, ret_name, &inode)){
-    if (free_map_allocate (1, &sector) &&dir_create (sector, 0)){
+    if (free_map_allocate_inode (inode_get_inumber (dir_get_inode (ret_dir)), true, &sector) &&dir_create (sector, 0)){
       success = dir_add (ret_dir, ret_name, sector);
       dir_close (ret_dir);
       free (ret_name);
@@ -1,52 +1,417 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Allocating and releasing sectors only changes the in-memory
+   free map and marks the sectors of the free map file that hold
+   the changed bits as dirty.  free_map_flush() writes just the
+   dirty sectors to the file, from which the buffer cache writes
+   them to disk like any other data.  The free map is flushed by
+   the cache's write-behind thread and when the free map is
+   closed at shutdown, so a burst of allocations costs one write
+   of each free map sector it touched.
+
+   For locality, the device is divided into block groups of
+   GROUP_SECTORS sectors, each described by one sector of the free
+   map.  A new file's inode goes in its directory's group, a new
+   directory's inode goes in the next group with a fair share of
+   free space so that directories spread across the device, and
+   the extents of an inode's data and indirect tables are taken
+   near the inode, preferably in the same group.
+
+   A growing file may also reserve sectors ahead of its end with
+   free_map_reserve(), claiming them with free_map_claim() as it
+   uses them.  Reservations are recorded only in USED_MAP, which
+   every search consults, and never in FREE_MAP, which is what
+   goes to disk, so an unclean stop cannot leak them.
+
+   Most allocations run under the file system lock, but the
+   write-behind thread can also claim, unreserve and release
+   sectors when it writes back or closes an inode, so MAP_LOCK
+   guards the maps and group counts.  It is never held across
+   I/O. */
+
+/* Free map bits held by one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors per block group. */
+#define GROUP_SECTORS BITS_PER_SECTOR
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *used_map;      /* FREE_MAP plus reservations. */
+static struct bitmap *dirty_map;     /* Free map file sectors to write. */
+static struct lock free_map_lock;    /* Serializes flushes. */
+static struct lock map_lock;         /* Protects the maps and groups. */
+
+static size_t group_cnt;             /* Number of block groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t last_dir_group;        /* Group of the newest directory. */
+
+static void count_free (void);
+static void reset_used_map (void);
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
   free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  used_map = bitmap_create (block_size (fs_device));
+  if (free_map == NULL || used_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                           BLOCK_SECTOR_SIZE));
+  if (dirty_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("block group allocation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  lock_init (&map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (used_map, FREE_MAP_SECTOR);
+  bitmap_mark (used_map, ROOT_DIR_SECTOR);
+  count_free ();
+}
+
+/* Recounts the free, unreserved sectors in each block group. */
+static void
+count_free (void)
+{
+  size_t size = bitmap_size (used_map);
+  size_t i;
+
+  for (i = 0; i < group_cnt; i++)
+    {
+      size_t start = i * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+      group_free[i] = bitmap_count (used_map, start, cnt, false);
+    }
+}
+
+/* Marks the free map file sectors that hold the bits for the CNT
+   sectors starting at SECTOR as needing to be written. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Updates the block groups' free counts after the CNT sectors
+   starting at SECTOR were marked in USED_MAP, if TAKEN is true,
+   or cleared in it, if TAKEN is false. */
+static void
+count_change (block_sector_t sector, size_t cnt, bool taken)
+{
+  while (cnt > 0)
+    {
+      size_t group = sector / GROUP_SECTORS;
+      size_t n = (group + 1) * GROUP_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+      if (taken)
+        group_free[group] -= n;
+      else
+        group_free[group] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Records in FREE_MAP that the CNT sectors starting at SECTOR,
+   already marked in USED_MAP, are allocated. */
+static void
+commit (block_sector_t sector, size_t cnt)
+{
+  ASSERT (bitmap_all (used_map, sector, cnt));
+  ASSERT (bitmap_none (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  mark_dirty (sector, cnt);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+
+  lock_acquire (&map_lock);
+  sector = bitmap_scan_and_flip (used_map, 0, cnt, false);
+  if (sector != BITMAP_ERROR)
+    {
+      count_change (sector, cnt, true);
+      commit (sector, cnt);
+      *sectorp = sector;
+    }
+  lock_release (&map_lock);
+  return sector != BITMAP_ERROR;
+}
+
+/* Returns the block group for a new directory: the first group
+   after the newest directory's that has at least the average
+   number of free sectors. */
+static size_t
+pick_dir_group (void)
+{
+  size_t total = 0;
+  size_t avg, group, i;
+
+  for (i = 0; i < group_cnt; i++)
+    total += group_free[i];
+  avg = total / group_cnt;
+
+  group = last_dir_group;
+  for (i = 1; i <= group_cnt; i++)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      size_t g = (last_dir_group + i) % group_cnt;
+      if (group_free[g] > 0 && group_free[g] >= avg)
+        {
+          group = g;
+          break;
+        }
     }
+  last_dir_group = group;
+  return group;
+}
+
+/* Allocates a sector for a new inode and stores it into *SECTORP.
+   A file's inode, if IS_DIR is false, is placed in the block group
+   of PARENT, the inode of the directory that will hold it; a
+   directory's inode is placed in a group chosen to spread
+   directories out.  Within the group, the inode takes the first
+   free sector.  Returns true if successful, false if the device is
+   full. */
+bool
+free_map_allocate_inode (block_sector_t parent, bool is_dir,
+                         block_sector_t *sectorp)
+{
+  size_t group, sector;
+
+  lock_acquire (&map_lock);
+  group = is_dir ? pick_dir_group () : parent / GROUP_SECTORS;
+  if (group >= group_cnt)
+    group = 0;
+  sector = bitmap_scan_and_flip (used_map, group * GROUP_SECTORS, 1, false);
+  if (sector == BITMAP_ERROR)
+    sector = bitmap_scan_and_flip (used_map, 0, 1, false);
   if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+    {
+      count_change (sector, 1, true);
+      commit (sector, 1);
+      *sectorp = sector;
+    }
+  lock_release (&map_lock);
   return sector != BITMAP_ERROR;
 }
 
+/* Returns the number of free sectors in the run that starts at
+   SECTOR, up to MAX.  Returns 0 if SECTOR itself is in use or
+   reserved. */
+static size_t
+free_run_length (size_t sector, size_t max)
+{
+  size_t end = bitmap_scan (used_map, sector, 1, true);
+  if (end == BITMAP_ERROR)
+    end = bitmap_size (used_map);
+  return end - sector < max ? end - sector : max;
+}
+
+/* Finds the longest run of free sectors in the free map, stores
+   its first sector into *SECTORP, and returns its length, up to
+   MAX.  Returns 0 if no sector is free. */
+static size_t
+longest_free_run (size_t max, size_t *sectorp)
+{
+  size_t size = bitmap_size (used_map);
+  size_t best = 0;
+  size_t sector = 0;
+
+  while (best < max && sector < size)
+    {
+      size_t len;
+
+      sector = bitmap_scan (used_map, sector, 1, false);
+      if (sector == BITMAP_ERROR)
+        break;
+      len = free_run_length (sector, max);
+      if (len > best)
+        {
+          best = len;
+          *sectorp = sector;
+        }
+      sector += len;
+    }
+  return best;
+}
+
+/* Finds an extent of up to CNT consecutive free sectors, as close
+   to sector GOAL as possible, marks it in USED_MAP, stores its
+   first sector into *SECTORP, and returns its length.  In order
+   of preference, the
+   extent is the free run that starts at GOAL itself, so that a
+   growing file continues where it left off; the first run of CNT
+   free sectors after GOAL in GOAL's block group; the first such
+   run earlier in the group; the first such run after the group,
+   wrapping around to the start of the device; or, if no run is
+   that long, the longest free run.  Returns 0 if the device is
+   full. */
+static size_t
+find_extent (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
+{
+  size_t sector = goal;
+  size_t len;
+
+  ASSERT (cnt > 0);
+
+  if (sector >= bitmap_size (used_map))
+    sector = 0;
+  len = free_run_length (sector, cnt);
+  if (len == 0)
+    {
+      size_t group_start = ROUND_DOWN (sector, GROUP_SECTORS);
+      size_t found = bitmap_scan (used_map, sector, cnt, false);
+      if (found == BITMAP_ERROR || found >= group_start + GROUP_SECTORS)
+        {
+          size_t earlier = bitmap_scan (used_map, group_start, cnt, false);
+          if (earlier < sector)
+            found = earlier;
+          else if (found == BITMAP_ERROR)
+            found = bitmap_scan (used_map, 0, cnt, false);
+        }
+      sector = found;
+      if (sector != BITMAP_ERROR)
+        len = cnt;
+      else
+        len = longest_free_run (cnt, &sector);
+      if (len == 0)
+        return 0;
+    }
+
+  bitmap_set_multiple (used_map, sector, len, true);
+  count_change (sector, len, true);
+  *sectorp = sector;
+  return len;
+}
+
+/* Allocates an extent of up to CNT consecutive sectors, as close
+   to sector GOAL as possible, stores its first sector into
+   *SECTORP, and returns its length.  See find_extent() for where
+   the extent is placed.  The caller must allocate the rest of
+   CNT, if any, with another call.  Returns 0 if the device is
+   full. */
+size_t
+free_map_allocate_extent (block_sector_t goal, size_t cnt,
+                          block_sector_t *sectorp)
+{
+  size_t len;
+
+  lock_acquire (&map_lock);
+  len = find_extent (goal, cnt, sectorp);
+  if (len > 0)
+    commit (*sectorp, len);
+  lock_release (&map_lock);
+  return len;
+}
+
+/* Reserves an extent of up to CNT consecutive sectors, placed as
+   free_map_allocate_extent() would place it, so that no other
+   allocation takes it.  The reservation lives in memory only: it
+   must be claimed with free_map_claim() or given back with
+   free_map_unreserve() before it means anything on disk.  Stores
+   the extent's first sector into *SECTORP and returns its length,
+   or 0 if the device is full. */
+size_t
+free_map_reserve (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
+{
+  size_t len;
+
+  lock_acquire (&map_lock);
+  len = find_extent (goal, cnt, sectorp);
+  lock_release (&map_lock);
+  return len;
+}
+
+/* Allocates the CNT reserved sectors starting at SECTOR. */
+void
+free_map_claim (block_sector_t sector, size_t cnt)
+{
+  if (cnt > 0)
+    {
+      lock_acquire (&map_lock);
+      commit (sector, cnt);
+      lock_release (&map_lock);
+    }
+}
+
+/* Gives back the CNT reserved, unclaimed sectors starting at
+   SECTOR. */
+void
+free_map_unreserve (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&map_lock);
+  ASSERT (bitmap_all (used_map, sector, cnt));
+  ASSERT (bitmap_none (free_map, sector, cnt));
+  bitmap_set_multiple (used_map, sector, cnt, false);
+  count_change (sector, cnt, false);
+  lock_release (&map_lock);
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  bitmap_set_multiple (used_map, sector, cnt, false);
+  mark_dirty (sector, cnt);
+  count_change (sector, cnt, false);
+  lock_release (&map_lock);
+}
+
+/* Writes the sectors of the free map file whose bits have changed
+   since they were last written, in runs of adjacent sectors.  Does
+   nothing if the free map file is not open. */
+void
+free_map_flush (void)
+{
+  size_t first, end;
+
+  if (free_map_file == NULL)
+    return;
+
+  lock_acquire (&free_map_lock);
+  for (first = bitmap_scan (dirty_map, 0, 1, true);
+       first != BITMAP_ERROR && free_map_file != NULL;
+       first = bitmap_scan (dirty_map, end, 1, true))
+    {
+      end = bitmap_scan (dirty_map, first, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (dirty_map);
+
+      /* Clean the run before copying it, so that bits that change
+         during the write dirty it again. */
+      bitmap_set_multiple (dirty_map, first, end - first, false);
+      if (!bitmap_write_part (free_map, free_map_file,
+                              first * BITS_PER_SECTOR,
+                              (end - first) * BITS_PER_SECTOR))
+        PANIC ("can't write free map");
+    }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +423,36 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  reset_used_map ();
+  count_free ();
+}
+
+/* Makes USED_MAP match FREE_MAP, without any reservations. */
+static void
+reset_used_map (void)
+{
+  size_t start, end;
+
+  bitmap_set_all (used_map, false);
+  for (start = bitmap_scan (free_map, 0, 1, true); start != BITMAP_ERROR;
+       start = bitmap_scan (free_map, end, 1, true))
+    {
+      end = bitmap_scan (free_map, start, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (free_map);
+      bitmap_set_multiple (used_map, start, end - start, true);
+    }
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
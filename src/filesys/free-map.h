@@ -10,8 +10,16 @@ void free_map_read (void);
 void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
+void free_map_flush (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_inode (block_sector_t parent, bool is_dir,
+                              block_sector_t *);
+size_t free_map_allocate_extent (block_sector_t goal, size_t cnt,
+                                 block_sector_t *);
+size_t free_map_reserve (block_sector_t goal, size_t cnt, block_sector_t *);
+void free_map_claim (block_sector_t, size_t);
+void free_map_unreserve (block_sector_t, size_t);
 void free_map_release (block_sector_t, size_t);
 
 #endif /* filesys/free-map.h */
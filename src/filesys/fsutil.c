@@ -1,5 +1,6 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,13 @@
 #include "threads/palloc.h"
 #include "threads/vaddr.h"
 
+/* Bytes moved to or from the scratch device at once by
+   fsutil_extract() and fsutil_append(). */
+#define FSUTIL_CHUNK_SIZE PGSIZE
+
+/* Where fsutil_append() writes next on the scratch device. */
+static block_sector_t append_sector;
+
 /* List files in the root directory. */
 void
 fsutil_ls (char **argv UNUSED) 
@@ -67,6 +75,68 @@ fsutil_rm (char **argv)
     PANIC ("%s: delete failed\n", file_name);
 }
 
+/* A scratch device transfer that runs while the caller works on
+   the file system, so that a scratch disk on the other IDE
+   channel is busy at the same time as the file system disk. */
+struct scratch_io
+  {
+    struct block_request request;
+    struct semaphore done;
+    bool busy;                  /* Submitted and not yet waited for? */
+  };
+
+/* Completion function for scratch_io requests. */
+static void
+scratch_io_complete (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Starts moving CNT sectors starting at SECTOR between BLOCK and
+   BUFFER as IO, which must not be busy. */
+static void
+scratch_io_start (struct scratch_io *io, struct block *block, bool write,
+                  block_sector_t sector, size_t cnt, void *buffer)
+{
+  ASSERT (!io->busy);
+  sema_init (&io->done, 0);
+  io->request.write = write;
+  io->request.sector = sector;
+  io->request.cnt = cnt;
+  io->request.buffer = buffer;
+  io->request.iov = NULL;
+  io->request.complete = scratch_io_complete;
+  io->request.aux = &io->done;
+  io->busy = true;
+  block_submit (block, &io->request);
+}
+
+/* Waits for IO to complete, if it is busy. */
+static void
+scratch_io_wait (struct scratch_io *io)
+{
+  if (io->busy)
+    {
+      sema_down (&io->done);
+      io->busy = false;
+    }
+}
+
+/* Starts reading the next chunk of a file's data, up to SIZE
+   bytes, from *SECTOR on SRC into BUFFER as IO, and advances
+   *SECTOR past it.  Returns the number of bytes in the chunk. */
+static int
+start_chunk_read (struct scratch_io *io, struct block *src,
+                  block_sector_t *sector, int size, void *buffer)
+{
+  int chunk_size = size > FSUTIL_CHUNK_SIZE ? FSUTIL_CHUNK_SIZE : size;
+  size_t sector_cnt = DIV_ROUND_UP (chunk_size, BLOCK_SECTOR_SIZE);
+
+  scratch_io_start (io, src, false, *sector, sector_cnt, buffer);
+  *sector += sector_cnt;
+  return chunk_size;
+}
+
 /* Extracts a ustar-format tar archive from the scratch block
    device into the Pintos file system. */
 void
@@ -75,13 +145,16 @@ fsutil_extract (char **argv UNUSED)
   static block_sector_t sector = 0;
 
   struct block *src;
-  void *header, *data;
+  void *header, *data[2];
+  struct scratch_io io[2];
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
-  if (header == NULL || data == NULL)
+  data[0] = malloc (FSUTIL_CHUNK_SIZE);
+  data[1] = malloc (FSUTIL_CHUNK_SIZE);
+  if (header == NULL || data[0] == NULL || data[1] == NULL)
     PANIC ("couldn't allocate buffers");
+  io[0].busy = io[1].busy = false;
 
   /* Open source block device. */
   src = block_get_role (BLOCK_SCRATCH);
@@ -124,14 +197,24 @@ fsutil_extract (char **argv UNUSED)
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
-          /* Do copy. */
-          while (size > 0)
+          /* Do copy, reading chunk I + 1 from scratch while
+             writing chunk I into the file system. */
+          int left_to_read = size;
+          int i;
+          for (i = 0; size > 0; i++)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
+              int chunk_size = (size > FSUTIL_CHUNK_SIZE
+                                ? FSUTIL_CHUNK_SIZE
                                 : size);
-              block_read (src, sector++, data);
-              if (file_write (dst, data, chunk_size) != chunk_size)
+              if (i == 0)
+                left_to_read -= start_chunk_read (&io[0], src, &sector,
+                                                  left_to_read, data[0]);
+              if (left_to_read > 0)
+                left_to_read -= start_chunk_read (&io[(i + 1) % 2], src,
+                                                  &sector, left_to_read,
+                                                  data[(i + 1) % 2]);
+              scratch_io_wait (&io[i % 2]);
+              if (file_write (dst, data[i % 2], chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
               size -= chunk_size;
@@ -151,7 +234,8 @@ fsutil_extract (char **argv UNUSED)
   block_write (src, 0, header);
   block_write (src, 1, header);
 
-  free (data);
+  free (data[1]);
+  free (data[0]);
   free (header);
 }
 
@@ -160,26 +244,29 @@ fsutil_extract (char **argv UNUSED)
 
    The first call to this function will write starting at the
    beginning of the scratch device.  Later calls advance across
-   the device.  This position is independent of that used for
-   fsutil_extract(), so `extract' should precede all
-   `append's. */
+   the device, as does fsutil_append_trace().  This position is
+   independent of that used for fsutil_extract(), so `extract'
+   should precede all `append's. */
 void
 fsutil_append (char **argv)
 {
-  static block_sector_t sector = 0;
-
+  block_sector_t sector = append_sector;
   const char *file_name = argv[1];
-  void *buffer;
+  void *buffer[2];
+  struct scratch_io io[2];
   struct file *src;
   struct block *dst;
   off_t size;
+  int i;
 
   printf ("Appending '%s' to ustar archive on scratch device...\n", file_name);
 
-  /* Allocate buffer. */
-  buffer = malloc (BLOCK_SECTOR_SIZE);
-  if (buffer == NULL)
+  /* Allocate buffers. */
+  buffer[0] = malloc (FSUTIL_CHUNK_SIZE);
+  buffer[1] = malloc (FSUTIL_CHUNK_SIZE);
+  if (buffer[0] == NULL || buffer[1] == NULL)
     PANIC ("couldn't allocate buffer");
+  io[0].busy = io[1].busy = false;
 
   /* Open source file. */
   src = filesys_open (file_name);
@@ -193,31 +280,61 @@ fsutil_append (char **argv)
     PANIC ("couldn't open scratch device");
   
   /* Write ustar header to first sector. */
-  if (!ustar_make_header (file_name, USTAR_REGULAR, size, buffer))
+  if (!ustar_make_header (file_name, USTAR_REGULAR, size, buffer[0]))
     PANIC ("%s: name too long for ustar format", file_name);
-  block_write (dst, sector++, buffer);
+  block_write (dst, sector++, buffer[0]);
 
-  /* Do copy. */
-  while (size > 0) 
+  /* Do copy, writing chunk I to scratch while reading chunk I + 1
+     from the file system. */
+  for (i = 0; size > 0; i++)
     {
-      int chunk_size = size > BLOCK_SECTOR_SIZE ? BLOCK_SECTOR_SIZE : size;
-      if (sector >= block_size (dst))
+      int chunk_size = size > FSUTIL_CHUNK_SIZE ? FSUTIL_CHUNK_SIZE : size;
+      size_t sector_cnt = DIV_ROUND_UP (chunk_size, BLOCK_SECTOR_SIZE);
+      uint8_t *chunk = buffer[i % 2];
+
+      if (sector + sector_cnt > block_size (dst))
         PANIC ("%s: out of space on scratch device", file_name);
-      if (file_read (src, buffer, chunk_size) != chunk_size)
+      scratch_io_wait (&io[i % 2]);
+      if (file_read (src, chunk, chunk_size) != chunk_size)
         PANIC ("%s: read failed with %"PROTd" bytes unread", file_name, size);
-      memset (buffer + chunk_size, 0, BLOCK_SECTOR_SIZE - chunk_size);
-      block_write (dst, sector++, buffer);
+      memset (chunk + chunk_size, 0,
+              sector_cnt * BLOCK_SECTOR_SIZE - chunk_size);
+      scratch_io_start (&io[i % 2], dst, true, sector, sector_cnt, chunk);
+      sector += sector_cnt;
       size -= chunk_size;
     }
+  scratch_io_wait (&io[0]);
+  scratch_io_wait (&io[1]);
 
   /* Write ustar end-of-archive marker, which is two consecutive
      sectors full of zeros.  Don't advance our position past
      them, though, in case we have more files to append. */
-  memset (buffer, 0, BLOCK_SECTOR_SIZE);
-  block_write (dst, sector, buffer);
-  block_write (dst, sector + 1, buffer);
+  memset (buffer[0], 0, 2 * BLOCK_SECTOR_SIZE);
+  block_write_range (dst, sector, 2, buffer[0]);
+  append_sector = sector;
 
   /* Finish up. */
   file_close (src);
-  free (buffer);
+  free (buffer[1]);
+  free (buffer[0]);
+}
+
+/* Appends the block I/O trace, if tracing is enabled, to the
+   ustar archive on the scratch device as file "blktrace", after
+   any files copied there by fsutil_append().  This stops
+   tracing. */
+void
+fsutil_append_trace (void)
+{
+  struct block *dst;
+
+  if (!block_trace_enabled ())
+    return;
+  dst = block_get_role (BLOCK_SCRATCH);
+  if (dst == NULL)
+    {
+      printf ("No scratch device for block trace\n");
+      return;
+    }
+  append_sector += block_trace_dump (dst, append_sector);
 }
@@ -13,6 +13,10 @@
 #define INODE_MAGIC 0x494e4f44
 #define INODE_TABLE_LENGTH 128
 
+/* A file that grows reserves free sectors ahead of its end in
+   windows of this many, so that appends to files growing at the
+   same time do not interleave on disk. */
+#define PREALLOC_SECTORS 64
 
 static char zeros[BLOCK_SECTOR_SIZE];
 
@@ -45,6 +49,26 @@ get_direct_i(off_t pos)
 }
 /********************** END NEW CODE *************************/
 
+/* Writes DATA to on-disk inode SECTOR through the buffer cache,
+   marking it as metadata. */
+static void
+write_disk_inode (block_sector_t sector, const struct inode_disk *data)
+{
+  struct buffer_cache *b = cache_get (sector, CACHE_OVERWRITE | CACHE_META);
+  memcpy (b->buffer, data, BLOCK_SECTOR_SIZE);
+  cache_put (b, true);
+}
+
+/* Reads on-disk inode SECTOR into DATA through the buffer cache,
+   marking it as metadata. */
+static void
+read_disk_inode (block_sector_t sector, struct inode_disk *data)
+{
+  struct buffer_cache *b = cache_get (sector, CACHE_READ | CACHE_META);
+  memcpy (data, b->buffer, BLOCK_SECTOR_SIZE);
+  cache_put (b, false);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
@@ -61,43 +85,246 @@ byte_to_sector (const struct inode *inode, off_t pos)
     int indirect_table_entry = (pos - DIRECT_PTR_NUM * BLOCK_SECTOR_SIZE) / (INODE_TABLE_LENGTH * BLOCK_SECTOR_SIZE);
     int table_entry = (pos - DIRECT_PTR_NUM * BLOCK_SECTOR_SIZE - indirect_table_entry * INODE_TABLE_LENGTH * BLOCK_SECTOR_SIZE) / BLOCK_SECTOR_SIZE;
 
-    block_sector_t * table = (block_sector_t *)malloc(INODE_TABLE_LENGTH * sizeof(block_sector_t *));
-    memset(table, 0, INODE_TABLE_LENGTH * sizeof(block_sector_t *));
-    cache_read (inode->data.indirect_blocks[indirect_table_entry], table);
-
-    block_sector_t result = table[table_entry];
-    free (table);
+    struct buffer_cache *b = cache_get (inode->data.indirect_blocks[indirect_table_entry], CACHE_READ | CACHE_META);
+    block_sector_t result = ((block_sector_t *) b->buffer)[table_entry];
+    cache_put (b, false);
     return result;
   }
 
   return -1;
 }
 
-/* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+/* Open inodes, indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  open_inodes_lock is
+   never held across disk I/O, so that opening and closing files
+   does not wait for other inodes to be read or written. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;  /* Guards open_inodes. */
+static struct condition inode_loaded; /* Signaled when LOADING clears. */
+
+/* Writes INODE, which the caller holds open, back to disk if it
+   has changed since it was last written.  Only the copy into the
+   cache slot happens under open_inodes_lock, after the slot is
+   obtained, so that no disk I/O does. */
+static void
+write_back (struct inode *inode)
+{
+  struct buffer_cache *b;
+
+  if (!inode->dirty || inode->removed)
+    return;
+  b = cache_get (inode->sector, CACHE_OVERWRITE | CACHE_META);
+  lock_acquire (&open_inodes_lock);
+
+  /* Clean it before copying it, so that growth during the write
+     dirties it again. */
+  inode->dirty = false;
+  memcpy (b->buffer, &inode->data, BLOCK_SECTOR_SIZE);
+  lock_release (&open_inodes_lock);
+  cache_put (b, true);
+}
+
+/* Gives back the sectors that INODE has reserved for growth. */
 static void
-byte_to_sector_write (struct inode *inode, off_t pos) 
+release_window (struct inode *inode)
+{
+  if (inode->prealloc_cnt > 0)
+    free_map_unreserve (inode->prealloc_start, inode->prealloc_cnt);
+  inode->prealloc_cnt = 0;
+}
+
+/* Allocates, or reserves if RESERVE is true, an extent of up to
+   CNT sectors near sector GOAL, as free_map_allocate_extent() or
+   free_map_reserve() does.  If the device is full, takes back
+   every open inode's reserved window and tries again. */
+static size_t
+allocate_extent (block_sector_t goal, size_t cnt, block_sector_t *startp,
+                 bool reserve)
 {
-  block_sector_t result;
+  size_t (*allocate) (block_sector_t, size_t, block_sector_t *)
+    = reserve ? free_map_reserve : free_map_allocate_extent;
+  size_t n = allocate (goal, cnt, startp);
+  if (n == 0)
+    {
+      struct hash_iterator i;
+
+      lock_acquire (&open_inodes_lock);
+      hash_first (&i, &open_inodes);
+      while (hash_next (&i))
+        release_window (hash_entry (hash_cur (&i), struct inode, elem));
+      lock_release (&open_inodes_lock);
+      n = allocate (goal, cnt, startp);
+    }
+  return n;
+}
+
+/* Allocates an extent of up to CNT sectors for INODE near sector
+   GOAL, stores its first sector into *STARTP, and returns its
+   length, or 0 if the device is full.  If INODE is nonnull, the
+   extent comes out of INODE's reserved window, which is refilled
+   first, with CNT rounded up to PREALLOC_SECTORS, if it is
+   empty.  The window is reserved in memory only; its sectors are
+   allocated in the free map as they are taken from it. */
+static size_t
+take_extent (struct inode *inode, block_sector_t goal, size_t cnt,
+             block_sector_t *startp)
+{
+  size_t n;
+
+  if (inode == NULL)
+    return allocate_extent (goal, cnt, startp, false);
+
+  if (inode->prealloc_cnt == 0)
+    inode->prealloc_cnt = allocate_extent (goal,
+                                           ROUND_UP (cnt, PREALLOC_SECTORS),
+                                           &inode->prealloc_start, true);
+  n = cnt < inode->prealloc_cnt ? cnt : inode->prealloc_cnt;
+  free_map_claim (inode->prealloc_start, n);
+  *startp = inode->prealloc_start;
+  inode->prealloc_start += n;
+  inode->prealloc_cnt -= n;
+  return n;
+}
+
+/* Allocates CNT data sectors for INODE, which is null for an inode
+   being created, into SECTORS[], in as few contiguous extents as
+   the free map allows, the first as close to sector GOAL as
+   possible, and zero-fills them if ZERO is true.  Returns true if
+   successful.  On failure, releases whatever it allocated and
+   returns false. */
+static bool
+allocate_sectors (struct inode *inode, block_sector_t *sectors, size_t cnt,
+                  block_sector_t goal, bool zero)
+{
+  size_t i = 0;
+
+  while (i < cnt)
+    {
+      block_sector_t start;
+      size_t n = take_extent (inode, goal, cnt - i, &start);
+      if (n == 0)
+        {
+          while (i-- > 0)
+            free_map_release (sectors[i], 1);
+          return false;
+        }
+      for (; n > 0; n--)
+        {
+          sectors[i++] = start;
+          if (zero)
+            cache_write (start, zeros);
+          start++;
+        }
+      goal = start;
+    }
+  return true;
+}
+
+/* Allocates one sector for an indirect table of INODE, which is
+   null for an inode being created, as close to sector GOAL as
+   possible and stores it into *SECTORP.  Returns true if
+   successful, false on failure. */
+static bool
+allocate_table (struct inode *inode, block_sector_t *sectorp,
+                block_sector_t goal)
+{
+  return take_extent (inode, goal, 1, sectorp) == 1;
+}
+
+/* Zero-fills file sectors FIRST up to LAST, exclusive, of INODE,
+   which were just added to it, except those that the write of
+   bytes WRITE_START up to WRITE_END, exclusive, will overwrite
+   entirely. */
+static void
+zero_new_sectors (const struct inode *inode, size_t first, size_t last,
+                  off_t write_start, off_t write_end)
+{
+  size_t i;
+
+  for (i = first; i < last; i++)
+    {
+      off_t ofs = (off_t) i * BLOCK_SECTOR_SIZE;
+      if (ofs < write_start || ofs + BLOCK_SECTOR_SIZE > write_end)
+        cache_write (byte_to_sector (inode, ofs), zeros);
+    }
+}
+
+/* Frees the data sectors of INODE for file sectors FIRST up to
+   LAST, exclusive, and its indirect tables TABLE_FIRST up to
+   TABLE_LAST, exclusive, whose pointers are cleared.  Used to undo
+   a failed byte_to_sector_write() and to free a removed file. */
+static void
+release_sectors (struct inode *inode, size_t first, size_t last,
+                size_t table_first, size_t table_last)
+{
+  size_t i = first;
+
+  for (; i < last && i < INODE_DIRECT_N; i++)
+    free_map_release (inode->data.direct_blocks[i], 1);
+  while (i < last)
+    {
+      size_t table_entry = (i - INODE_DIRECT_N) / INODE_TABLE_LENGTH;
+      size_t table_end = (INODE_DIRECT_N
+                          + (table_entry + 1) * INODE_TABLE_LENGTH);
+      struct buffer_cache *b
+        = cache_get (inode->data.indirect_blocks[table_entry],
+                     CACHE_READ | CACHE_META);
+      const block_sector_t *table = (const block_sector_t *) b->buffer;
+
+      for (; i < last && i < table_end; i++)
+        free_map_release (table[(i - INODE_DIRECT_N) % INODE_TABLE_LENGTH],
+                          1);
+      cache_put (b, false);
+    }
+  for (i = table_first; i < table_last; i++)
+    {
+      free_map_release (inode->data.indirect_blocks[i], 1);
+      inode->data.indirect_blocks[i] = 0;
+    }
+}
+
+/* Extends INODE, if necessary, so that it contains byte offset
+   POS, for a write that starts at byte WRITE_START, and returns
+   the block device sector that contains POS.  New sectors are
+   zero-filled, except those the write covers entirely.  New
+   sectors are allocated in extents that continue from the
+   file's last sector, out of the inode's reserved window, so
+   that a file grown by appending stays contiguous on disk.  The
+   on-disk inode is not rewritten here but by inode_flush_all()
+   or when the inode is closed.
+   Returns -1 if the disk is full, after giving back whatever
+   sectors it had allocated. */
+static block_sector_t
+byte_to_sector_write (struct inode *inode, off_t pos, off_t write_start)
+{
+  block_sector_t result = -1;
   if (pos < inode->data.length){
       result = byte_to_sector (inode, pos);
       return result;
     }else{
       size_t sector_end = bytes_to_sectors (inode->data.length);
       size_t sector_off = bytes_to_sectors (pos+1);
+      /* Allocate near the current last sector, or right after the
+         inode itself for an empty file. */
+      block_sector_t goal = (sector_end > 0
+                             ? byte_to_sector (inode, inode->data.length - 1) + 1
+                             : inode->sector + 1);
+      /* File sectors allocated so far. */
+      size_t sector_done = sector_end;
       if (sector_end < INODE_DIRECT_N){
           size_t sectors_direct_new = sector_off < INODE_DIRECT_N ? sector_off : INODE_DIRECT_N;
-          for (size_t i=sector_end; i<sectors_direct_new; i++){
-              free_map_allocate (1, &inode->data.direct_blocks[i]);
-              cache_write (inode->data.direct_blocks[i], zeros);
-            }
+          if (!allocate_sectors (inode, &inode->data.direct_blocks[sector_end],
+                                 sectors_direct_new - sector_end, goal,
+                                 false))
+            return -1;
+          sector_done = sectors_direct_new;
+          goal = inode->data.direct_blocks[sectors_direct_new-1] + 1;
         }
 
       if (sector_off <= INODE_DIRECT_N){
           inode->data.length = pos+1;
-          cache_write (inode->sector, &inode->data);
+          inode->dirty = true;
+          zero_new_sectors (inode, sector_end, sector_off, write_start, pos+1);
           return inode->data.direct_blocks[sector_off-1];
         }
 
@@ -109,62 +336,81 @@ byte_to_sector_write (struct inode *inode, off_t pos)
       size_t indirect_sector_end = sector_end > INODE_DIRECT_N ? sector_end-INODE_DIRECT_N : 0;
       size_t table_n_old = (indirect_sector_end+INODE_TABLE_LENGTH-1) / INODE_TABLE_LENGTH;  // how many tables
       size_t indirect_sector_off = sector_off - INODE_DIRECT_N;
-      block_sector_t *table = calloc(INODE_TABLE_LENGTH, sizeof (block_sector_t*));
+      size_t table_n_new = table_n_old;  // tables allocated so far
     /* We start from the sector number of the first in the indirect area, step is INODE_TABLE_LENGTH */
       for (size_t i= (indirect_sector_end/ INODE_TABLE_LENGTH)*INODE_TABLE_LENGTH; i<indirect_sector_off; i+=INODE_TABLE_LENGTH){
           size_t bytes_left_end;
           size_t indirect_table_entry = i / INODE_TABLE_LENGTH;
+          struct buffer_cache *b;
+          block_sector_t *table;
           /* Calculate bytes_left_end, which is the bytes that is left in the last block 
-                set the whole block to 0 as well. */
+                set the whole block to 0 as well.  The table is
+                updated in place in the cache. */
           if (indirect_table_entry+1 > table_n_old) {
-              if (!free_map_allocate (1, &inode->data.indirect_blocks[indirect_table_entry])) {
-                  free (table);
-                  return -1;
-                }
-              memset (table, 0, BLOCK_SECTOR_SIZE);
+              if (!allocate_table (inode, &inode->data.indirect_blocks[indirect_table_entry], goal))
+                goto fail;
+              table_n_new = indirect_table_entry + 1;
+              goal = inode->data.indirect_blocks[indirect_table_entry] + 1;
+              b = cache_get (inode->data.indirect_blocks[indirect_table_entry], CACHE_OVERWRITE | CACHE_META);
+              memset (b->buffer, 0, BLOCK_SECTOR_SIZE);
               bytes_left_end = 0;
             }
           else
             {
-
-              cache_read (inode->data.indirect_blocks[indirect_table_entry], table);
-              // struct read_ahead * read_ahead_unit = (struct read_ahead*)malloc(sizeof(struct read_ahead*));
-                  // read_ahead_unit->block_to_read = i;
-                  // read_ahead_unit->buffer = inode->data.indirect_pointer[indirect_table_entry + 1];
-                  // list_push_back(&read_ahead_list, &read_ahead_unit->elem);
-                  // cond_signal(&read_ahead_cond, &read_ahead_lock);
+              b = cache_get (inode->data.indirect_blocks[indirect_table_entry], CACHE_WRITE | CACHE_META);
               bytes_left_end = indirect_sector_end % INODE_TABLE_LENGTH;
             }
+          table = (block_sector_t *) b->buffer;
           
           size_t n_table_entry = (indirect_sector_off-i) < INODE_TABLE_LENGTH ? (indirect_sector_off-i) : INODE_TABLE_LENGTH;
           
-          for (size_t j=bytes_left_end; j<n_table_entry; j+=1){
-              if (!free_map_allocate (1, &table[j])){
-                  free (table);
-                  return -1;
-                }
-              cache_write (table[j], zeros);
+          if (!allocate_sectors (inode, &table[bytes_left_end],
+                                 n_table_entry - bytes_left_end, goal,
+                                 false)){
+              cache_put (b, true);
+              goto fail;
             }
-          cache_write (inode->data.indirect_blocks[indirect_table_entry], table);
+          sector_done = INODE_DIRECT_N + i + n_table_entry;
+          goal = table[n_table_entry-1] + 1;
+          result = table[(indirect_sector_off-1)%INODE_TABLE_LENGTH];
+          cache_put (b, true);
         }
-      result = table[(indirect_sector_off-1)%INODE_TABLE_LENGTH];
+      inode->data.length = pos+1;
+      inode->dirty = true;
+      zero_new_sectors (inode, sector_end, sector_off, write_start, pos+1);
+      return result;
 
-      free (table);
+    fail:
+      release_sectors (inode, sector_end, sector_done,
+                       table_n_old, table_n_new);
+      return -1;
     }
-    inode->data.length = pos+1;
+}
 
-    cache_write (inode->sector, &inode->data);
-    return result;
+/* Hashes an open inode by its sector number. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders two open inodes by sector number. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
 }
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("inode_init: out of memory");
+  lock_init (&open_inodes_lock);
+  cond_init (&inode_loaded);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -191,49 +437,50 @@ inode_create (block_sector_t sector, off_t length)
       disk_inode->magic = INODE_MAGIC;
       disk_inode->is_dir = false;
       size_t n_direct_blocks = sectors < INODE_DIRECT_N ? sectors : INODE_DIRECT_N;
-      for (size_t i=0; i<n_direct_blocks; i++){
-          if (!free_map_allocate (1, &disk_inode->direct_blocks[i]))
-            {
-              free (disk_inode);
-              return false;
-            }
-
-          cache_write (disk_inode->direct_blocks[i], zeros);
+      /* Lay the data out right after the inode, each indirect
+         table just ahead of the blocks it points to. */
+      block_sector_t goal = sector + 1;
+      if (!allocate_sectors (NULL, disk_inode->direct_blocks, n_direct_blocks, goal, true))
+        {
+          free (disk_inode);
+          return false;
         }
+      if (n_direct_blocks > 0)
+        goal = disk_inode->direct_blocks[n_direct_blocks-1] + 1;
 
       if (sectors <= INODE_DIRECT_N){
-          cache_write (sector, disk_inode);
+          write_disk_inode (sector, disk_inode);
           free (disk_inode);
           return true;
       }
       size_t n_indirect_blocks = sectors - INODE_DIRECT_N;
-      block_sector_t *table = calloc(INODE_TABLE_LENGTH, sizeof (block_sector_t*));
 
       for (size_t i=0; i<n_indirect_blocks; i+=INODE_TABLE_LENGTH){
           size_t indirect_table_entry = i / INODE_TABLE_LENGTH;
-          if (!free_map_allocate (1, &disk_inode->indirect_blocks[indirect_table_entry])) {
+          struct buffer_cache *b;
+          block_sector_t *table;
+          if (!allocate_table (NULL, &disk_inode->indirect_blocks[indirect_table_entry], goal)) {
               free (disk_inode);
-              free (table);
               return false;
             }
+          goal = disk_inode->indirect_blocks[indirect_table_entry] + 1;
 
+          /* Build the table in place in the cache. */
+          b = cache_get (disk_inode->indirect_blocks[indirect_table_entry], CACHE_OVERWRITE | CACHE_META);
+          table = (block_sector_t *) b->buffer;
           memset (table, 0, BLOCK_SECTOR_SIZE);
           size_t n_table_entry = (n_indirect_blocks-i) < INODE_TABLE_LENGTH ? (n_indirect_blocks-i) : INODE_TABLE_LENGTH;
-          for (size_t j=0; j<n_table_entry; j++){
-              if (!free_map_allocate (1, &table[j])){
-                  free (disk_inode);
-                  free (table);
-                  return false;
-                }
-              cache_write (table[j], zeros);
+          if (!allocate_sectors (NULL, table, n_table_entry, goal, true)){
+              cache_put (b, true);
+              free (disk_inode);
+              return false;
             }
-    
-          cache_write (disk_inode->indirect_blocks[indirect_table_entry], table);
+          goal = table[n_table_entry-1] + 1;
+          cache_put (b, true);
         }
       success = true;
-      free (table);
 
-      cache_write (sector, disk_inode);
+      write_disk_inode (sector, disk_inode);
       free (disk_inode);
     }
   return success;
@@ -245,33 +492,49 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct hash_elem *e;
   struct inode *inode;
+  struct inode key;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  key.sector = sector;
+  lock_acquire (&open_inodes_lock);
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      while (inode->loading)
+        cond_wait (&inode_loaded, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  Other openers of the same inode wait for it to
+     be read in, without holding open_inodes_lock. */
   inode->sector = sector;
+  hash_insert (&open_inodes, &inode->elem);
   inode->open_cnt = 1;
+  inode->loading = true;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  cache_read (inode->sector, &inode->data);
+  inode->dirty = false;
+  inode->prealloc_cnt = 0;
+  lock_release (&open_inodes_lock);
+
+  read_disk_inode (inode->sector, &inode->data);
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  cond_broadcast (&inode_loaded, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
 
   return inode;
 }
@@ -281,7 +544,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -302,43 +569,34 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
   
+  /* If this is the last opener, write INODE back while it can
+     still be found in open_inodes, so that no one opens it afresh
+     from a stale copy on disk.  It may grow again meanwhile. */
+  lock_acquire (&open_inodes_lock);
+  while (inode->open_cnt == 1 && inode->dirty && !inode->removed)
+    {
+      lock_release (&open_inodes_lock);
+      write_back (inode);
+      lock_acquire (&open_inodes_lock);
+    }
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  bool last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      release_window (inode);
  
       /* Deallocate blocks if removed. */
-      if (inode->removed){
-          int32_t sector_num = bytes_to_sectors (inode->data.length);
-          if(sector_num < DIRECT_PTR_NUM + 1) {
-            free_map_release (inode->sector, 1);
-            free (inode);
-            return;
-          }
-          /* Free Direct blocks */
-          for (int32_t i = 0; i < DIRECT_PTR_NUM; i++) free_map_release (inode->data.direct_blocks[i], 1);
-          
-          uint32_t * table = (uint32_t*)malloc(INODE_TABLE_LENGTH * sizeof (uint32_t*));
-          memset(table, 0, INODE_TABLE_LENGTH * sizeof (uint32_t*));
-          /* Free the indirect blocks */
-          int32_t i = 0;
-          while(i < sector_num - DIRECT_PTR_NUM){
-            
-            int32_t indirect_table_entry = i / INODE_TABLE_LENGTH;
-            cache_read (inode->data.indirect_blocks[indirect_table_entry], table);
-
-            if((sector_num - DIRECT_PTR_NUM - i) >= INODE_TABLE_LENGTH){
-              for (int32_t j = 0; j < INODE_TABLE_LENGTH; j++)
-                free_map_release (table[j], 1);
-            }else{
-              for (int32_t j = 0; j < sector_num - DIRECT_PTR_NUM - i; j++)
-                free_map_release (table[j], 1);
-            }
-            i = i + INODE_TABLE_LENGTH;
-          }
-
-          free (table);
+      if (inode->removed)
+        {
+          size_t sector_cnt = bytes_to_sectors (inode->data.length);
+          size_t indirect_cnt = (sector_cnt > INODE_DIRECT_N
+                                 ? sector_cnt - INODE_DIRECT_N : 0);
+          release_sectors (inode, 0, sector_cnt, 0,
+                           DIV_ROUND_UP (indirect_cnt, INODE_TABLE_LENGTH));
           free_map_release (inode->sector, 1);
         }
 
@@ -346,6 +604,41 @@ inode_close (struct inode *inode)
     }
 }
 
+/* Writes every open inode that has grown since it was last
+   written back to disk, through the buffer cache.  Called by the
+   cache's write-behind thread, so that an inode reaches disk along
+   with the blocks it points to, and at shutdown by
+   filesys_done().  The dirty inodes are pinned by reopening them
+   under open_inodes_lock, then written outside it. */
+void
+inode_flush_all (void)
+{
+  struct hash_iterator i;
+  struct list dirty;
+
+  list_init (&dirty);
+  lock_acquire (&open_inodes_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->dirty && !inode->removed)
+        {
+          inode->open_cnt++;
+          list_push_back (&dirty, &inode->flush_elem);
+        }
+    }
+  lock_release (&open_inodes_lock);
+
+  while (!list_empty (&dirty))
+    {
+      struct inode *inode = list_entry (list_pop_front (&dirty),
+                                        struct inode, flush_elem);
+      write_back (inode);
+      inode_close (inode);
+    }
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -363,7 +656,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  enum cache_mode meta = inode_is_dir (inode) ? CACHE_META : 0;
 
   while (size > 0) 
     {
@@ -381,53 +674,69 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-
-          cache_read (sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          cache_read (sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      /* Copy straight out of the cache slot. */
+      struct buffer_cache *b = cache_get (sector_idx, CACHE_READ | meta);
+      memcpy (buffer + bytes_read, b->buffer + sector_ofs, chunk_size);
+      cache_put (b, false);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
   return bytes_read;
 }
 
+/* Pins and returns the cache slot holding the sector that
+   contains byte OFFSET of INODE, which must lie within the file,
+   for in-place access in the given MODE.  The caller must release
+   it with cache_put(). */
+struct buffer_cache *
+inode_get_sector (const struct inode *inode, off_t offset,
+                  enum cache_mode mode)
+{
+  ASSERT (offset < inode_length (inode));
+  return cache_get (byte_to_sector (inode, offset), mode);
+}
+
+/* Queues the sectors holding SIZE bytes of INODE starting at
+   OFFSET for read-ahead, stopping at end of file. */
+void
+inode_read_ahead (const struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+
+  if (end > inode_length (inode))
+    end = inode_length (inode);
+  for (offset = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE); offset < end;
+       offset += BLOCK_SECTOR_SIZE)
+    cache_read_ahead (byte_to_sector (inode, offset));
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   Returns the number of bytes actually written.  A write past
+   end of file extends the inode first; if the disk is too full
+   to extend it, nothing is written and 0 is returned. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  enum cache_mode meta = inode_is_dir (inode) ? CACHE_META : 0;
 
   if (inode->deny_write_cnt)
     return 0;
-  byte_to_sector_write (inode, offset+size-1);
+  if (size > 0
+      && byte_to_sector_write (inode, offset+size-1, offset)
+         == (block_sector_t) -1)
+    {
+      /* The disk is full, so don't keep space in reserve for a
+         file that cannot grow. */
+      release_window (inode);
+      return 0;
+    }
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
@@ -445,37 +754,19 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          cache_write (sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            cache_read (sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          cache_write (sector_idx, bounce);
-        }
+      /* Copy straight into the cache slot.  If the sector contains
+         data before or after the chunk we're writing, then it has
+         to be read in first; otherwise we overwrite all of it. */
+      bool partial = sector_ofs > 0 || chunk_size < BLOCK_SECTOR_SIZE;
+      struct buffer_cache *b = cache_get (sector_idx, (partial ? CACHE_WRITE : CACHE_OVERWRITE) | meta);
+      memcpy (b->buffer + sector_ofs, buffer + bytes_written, chunk_size);
+      cache_put (b, true);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
 
   return bytes_written;
 }
@@ -6,6 +6,7 @@
 #include "devices/block.h"
 #include "filesys/inode.h"
 #include <stdio.h>
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
@@ -42,11 +43,16 @@ struct inode_disk
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem flush_elem;        /* Element in a flush list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* DATA still being read from disk. */
     bool removed;                       /* True if deleted, false otherwise.*/
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    bool dirty;                         /* DATA not yet written to disk. */
+    block_sector_t prealloc_start;      /* Sectors reserved for growth... */
+    size_t prealloc_cnt;                /* ...and how many. */
     struct inode_disk data;             /* Inode content. */
   };
 
@@ -57,7 +63,11 @@ struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_flush_all (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead (const struct inode *, off_t offset, off_t size);
+struct buffer_cache *inode_get_sector (const struct inode *, off_t offset,
+                                       enum cache_mode);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -21,13 +22,39 @@ typedef unsigned long elem_type;
 /* Number of bits in an element. */
 #define ELEM_BITS (sizeof (elem_type) * CHAR_BIT)
 
+/* Number of elements summarized by each leaf of the summary
+   tree, and the number of bits that makes. */
+#define LEAF_ELEMS 8
+#define LEAF_BITS (LEAF_ELEMS * ELEM_BITS)
+
+/* Summary of the runs of false bits in a range of a bitmap.
+   Bits past the end of the bitmap count as true. */
+struct run_summary
+  {
+    size_t pre;         /* Length of the run that starts the range. */
+    size_t suf;         /* Length of the run that ends the range. */
+    size_t max;         /* Length of the longest run in the range. */
+  };
+
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   Searches are sped up by a summary tree: a complete binary tree
+   of run_summary, stored heap-fashion with the root at index 1,
+   whose LEAF_CNT leaves each summarize LEAF_BITS bits and whose
+   inner nodes each summarize their two children.  A search skips
+   any subtree that cannot contain what it is looking for, such
+   as one whose longest run of false bits is too short, so it
+   takes O(log n) time however full the bitmap is.  Every change
+   to the bits updates the tree, with interrupts off so that the
+   two always agree. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    size_t leaf_cnt;    /* Leaves in summary tree, a power of 2. */
+    struct run_summary *summary;        /* Summary tree. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -69,6 +96,31 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns the number of leaves in the summary tree for a bitmap
+   of BIT_CNT bits. */
+static size_t
+leaf_cnt (size_t bit_cnt)
+{
+  size_t need = DIV_ROUND_UP (bit_cnt, LEAF_BITS);
+  size_t cnt = 1;
+
+  while (cnt < need)
+    cnt *= 2;
+  return cnt;
+}
+
+/* Returns the number of bytes required for the summary tree of a
+   bitmap of BIT_CNT bits. */
+static inline size_t
+summary_byte_cnt (size_t bit_cnt)
+{
+  return 2 * leaf_cnt (bit_cnt) * sizeof (struct run_summary);
+}
+
+static void set_bits (struct bitmap *, size_t start, size_t cnt, bool);
+static void init_summary (struct bitmap *);
+static void update_summary (struct bitmap *, size_t start, size_t cnt);
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -83,11 +135,16 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
-      if (b->bits != NULL || bit_cnt == 0)
+      b->leaf_cnt = leaf_cnt (bit_cnt);
+      b->summary = malloc (summary_byte_cnt (bit_cnt));
+      if ((b->bits != NULL || bit_cnt == 0) && b->summary != NULL)
         {
-          bitmap_set_all (b, false);
+          set_bits (b, 0, bit_cnt, false);
+          init_summary (b);
           return b;
         }
+      free (b->bits);
+      free (b->summary);
       free (b);
     }
   return NULL;
@@ -105,7 +162,10 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
-  bitmap_set_all (b, false);
+  b->leaf_cnt = leaf_cnt (bit_cnt);
+  b->summary = (struct run_summary *) (b->bits + elem_cnt (bit_cnt));
+  set_bits (b, 0, bit_cnt, false);
+  init_summary (b);
   return b;
 }
 
@@ -114,7 +174,8 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt) 
 {
-  return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+  return (sizeof (struct bitmap) + byte_cnt (bit_cnt)
+          + summary_byte_cnt (bit_cnt));
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -125,6 +186,7 @@ bitmap_destroy (struct bitmap *b)
   if (b != NULL) 
     {
       free (b->bits);
+      free (b->summary);
       free (b);
     }
 }
@@ -158,11 +220,14 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
 {
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
+  enum intr_level old_level = intr_disable ();
 
   /* This is equivalent to `b->bits[idx] |= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, bit_idx, 1);
+  intr_set_level (old_level);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -171,11 +236,14 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
 {
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
+  enum intr_level old_level = intr_disable ();
 
   /* This is equivalent to `b->bits[idx] &= ~mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  update_summary (b, bit_idx, 1);
+  intr_set_level (old_level);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -186,11 +254,14 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
 {
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
+  enum intr_level old_level = intr_disable ();
 
   /* This is equivalent to `b->bits[idx] ^= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, bit_idx, 1);
+  intr_set_level (old_level);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -213,18 +284,21 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Bits are set atomically. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  enum intr_level old_level;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  old_level = intr_disable ();
+  set_bits (b, start, cnt, value);
+  update_summary (b, start, cnt);
+  intr_set_level (old_level);
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -288,6 +362,12 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+static size_t find_false_run (const struct bitmap *, size_t node, size_t lo,
+                              size_t span, size_t start, size_t cnt,
+                              size_t *run);
+static size_t find_true (const struct bitmap *, size_t node, size_t lo,
+                         size_t span, size_t start);
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
@@ -295,18 +375,47 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t root_span, idx, run;
+  enum intr_level old_level;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt == 0)
+    return start;
+  if (cnt > b->bit_cnt)
+    return BITMAP_ERROR;
+
+  old_level = intr_disable ();
+  root_span = b->leaf_cnt * LEAF_BITS;
+  if (!value)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      run = 0;
+      idx = find_false_run (b, 1, 0, root_span, start, cnt, &run);
     }
-  return BITMAP_ERROR;
+  else
+    {
+      /* Find each run of true bits in turn, by finding its first
+         bit and then the false bit that ends it. */
+      for (;;)
+        {
+          size_t end;
+
+          idx = find_true (b, 1, 0, root_span, start);
+          if (idx == BITMAP_ERROR || idx + cnt > b->bit_cnt)
+            {
+              idx = BITMAP_ERROR;
+              break;
+            }
+          run = 0;
+          end = find_false_run (b, 1, 0, root_span, idx, 1, &run);
+          if (end == BITMAP_ERROR || end - idx >= cnt)
+            break;
+          start = end;
+        }
+    }
+  intr_set_level (old_level);
+  return idx;
 }
 
 /* Finds the first group of CNT consecutive bits in B at or after
@@ -314,16 +423,272 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
    and returns the index of the first bit in the group.
    If there is no such group, returns BITMAP_ERROR.
    If CNT is zero, returns 0.
-   Bits are set atomically, but testing bits is not atomic with
-   setting them. */
+   The test and the flip together are atomic. */
 size_t
 bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
+  enum intr_level old_level = intr_disable ();
   size_t idx = bitmap_scan (b, start, cnt, value);
   if (idx != BITMAP_ERROR) 
     bitmap_set_multiple (b, idx, cnt, !value);
+  intr_set_level (old_level);
   return idx;
 }
+
+/* Summary tree. */
+
+/* Sets the CNT bits starting at START in B to VALUE, an element
+   at a time where possible, without updating the summary. */
+static void
+set_bits (struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t end = start + cnt;
+
+  while (start < end)
+    {
+      elem_type *e = &b->bits[elem_idx (start)];
+      if (start % ELEM_BITS == 0 && end - start >= ELEM_BITS)
+        {
+          *e = value ? (elem_type) -1 : 0;
+          start += ELEM_BITS;
+        }
+      else
+        {
+          if (value)
+            *e |= bit_mask (start);
+          else
+            *e &= ~bit_mask (start);
+          start++;
+        }
+    }
+}
+
+/* Recomputes the summary of leaf NODE of B's summary tree from
+   the bits it covers. */
+static void
+summarize_leaf (struct bitmap *b, size_t node)
+{
+  struct run_summary *s = &b->summary[node];
+  size_t lo = (node - b->leaf_cnt) * LEAF_BITS;
+  size_t end = lo + LEAF_BITS < b->bit_cnt ? lo + LEAF_BITS : b->bit_cnt;
+  bool in_prefix = true;
+  size_t run = 0;
+  size_t i = lo;
+
+  s->pre = s->max = 0;
+  while (i < end)
+    {
+      elem_type e = b->bits[elem_idx (i)];
+      bool one;
+
+      if (i % ELEM_BITS == 0 && end - i >= ELEM_BITS && e == 0)
+        {
+          run += ELEM_BITS;
+          i += ELEM_BITS;
+          continue;
+        }
+      if (i % ELEM_BITS == 0 && end - i >= ELEM_BITS && e == (elem_type) -1)
+        {
+          one = true;
+          i += ELEM_BITS;
+        }
+      else
+        {
+          one = (e & bit_mask (i)) != 0;
+          i++;
+        }
+      if (one)
+        {
+          if (in_prefix)
+            s->pre = run;
+          in_prefix = false;
+          if (run > s->max)
+            s->max = run;
+          run = 0;
+        }
+      else
+        run++;
+    }
+
+  /* Bits past the end of the bitmap end the last run. */
+  if (in_prefix)
+    s->pre = run;
+  if (run > s->max)
+    s->max = run;
+  s->suf = end == lo + LEAF_BITS ? run : 0;
+}
+
+/* Recomputes inner NODE of B's summary tree, whose children each
+   cover HALF bits, from its children. */
+static void
+summarize_node (struct bitmap *b, size_t node, size_t half)
+{
+  struct run_summary *s = &b->summary[node];
+  const struct run_summary *l = &b->summary[2 * node];
+  const struct run_summary *r = &b->summary[2 * node + 1];
+
+  s->pre = l->pre == half ? half + r->pre : l->pre;
+  s->suf = r->suf == half ? half + l->suf : r->suf;
+  s->max = l->suf + r->pre;
+  if (l->max > s->max)
+    s->max = l->max;
+  if (r->max > s->max)
+    s->max = r->max;
+}
+
+/* Computes all of B's summary tree from its bits. */
+static void
+init_summary (struct bitmap *b)
+{
+  size_t first, span, i;
+
+  for (i = b->leaf_cnt; i < 2 * b->leaf_cnt; i++)
+    summarize_leaf (b, i);
+  for (first = b->leaf_cnt / 2, span = LEAF_BITS; first > 0;
+       first /= 2, span *= 2)
+    for (i = first; i < 2 * first; i++)
+      summarize_node (b, i, span);
+}
+
+/* Updates B's summary tree after a change to the CNT bits
+   starting at START. */
+static void
+update_summary (struct bitmap *b, size_t start, size_t cnt)
+{
+  size_t first, last, span, i;
+
+  if (cnt == 0)
+    return;
+  first = b->leaf_cnt + start / LEAF_BITS;
+  last = b->leaf_cnt + (start + cnt - 1) / LEAF_BITS;
+  for (i = first; i <= last; i++)
+    summarize_leaf (b, i);
+  for (span = LEAF_BITS; first > 1; span *= 2)
+    {
+      first /= 2;
+      last /= 2;
+      for (i = first; i <= last; i++)
+        summarize_node (b, i, span);
+    }
+}
+
+/* Searches the subtree of B's summary tree rooted at NODE, which
+   covers the SPAN bits starting at LO, for the first run of CNT
+   false bits that starts at or after START, and returns the
+   index of its first bit, or BITMAP_ERROR if there is none.  On
+   entry, *RUN is the length of the run of false bits, starting
+   at or after START, that ends just before LO; on return, it is
+   the length of the one that ends at the end of the subtree. */
+static size_t
+find_false_run (const struct bitmap *b, size_t node, size_t lo, size_t span,
+                size_t start, size_t cnt, size_t *run)
+{
+  const struct run_summary *s = &b->summary[node];
+  size_t idx;
+
+  if (lo + span <= start)
+    return BITMAP_ERROR;
+  if (lo >= b->bit_cnt)
+    {
+      *run = 0;
+      return BITMAP_ERROR;
+    }
+  if (lo >= start)
+    {
+      /* Skip the whole subtree if the run can't end or lie in it. */
+      if (*run + s->pre >= cnt)
+        return lo - *run;
+      if (s->max < cnt)
+        {
+          *run = s->pre == span ? *run + span : s->suf;
+          return BITMAP_ERROR;
+        }
+    }
+
+  if (node < b->leaf_cnt)
+    {
+      idx = find_false_run (b, 2 * node, lo, span / 2, start, cnt, run);
+      if (idx == BITMAP_ERROR)
+        idx = find_false_run (b, 2 * node + 1, lo + span / 2, span / 2,
+                              start, cnt, run);
+      return idx;
+    }
+  else
+    {
+      /* Search the leaf's bits, an element at a time where
+         possible. */
+      size_t end = lo + span < b->bit_cnt ? lo + span : b->bit_cnt;
+      size_t i = lo > start ? lo : start;
+
+      while (i < end)
+        {
+          elem_type e = b->bits[elem_idx (i)];
+          if (i % ELEM_BITS == 0 && end - i >= ELEM_BITS
+              && (e == 0 || e == (elem_type) -1))
+            {
+              if (e != 0)
+                *run = 0;
+              else if (*run + ELEM_BITS >= cnt)
+                return i - *run;
+              else
+                *run += ELEM_BITS;
+              i += ELEM_BITS;
+            }
+          else
+            {
+              if (e & bit_mask (i))
+                *run = 0;
+              else if (++*run >= cnt)
+                return i + 1 - cnt;
+              i++;
+            }
+        }
+      if (end < lo + span)
+        *run = 0;
+      return BITMAP_ERROR;
+    }
+}
+
+/* Searches the subtree of B's summary tree rooted at NODE, which
+   covers the SPAN bits starting at LO, for the first true bit at
+   or after START, and returns its index, or BITMAP_ERROR if
+   there is none. */
+static size_t
+find_true (const struct bitmap *b, size_t node, size_t lo, size_t span,
+           size_t start)
+{
+  size_t idx;
+
+  /* A subtree that is one run of false bits has no true bit. */
+  if (lo + span <= start || lo >= b->bit_cnt
+      || b->summary[node].pre == span)
+    return BITMAP_ERROR;
+
+  if (node < b->leaf_cnt)
+    {
+      idx = find_true (b, 2 * node, lo, span / 2, start);
+      if (idx == BITMAP_ERROR)
+        idx = find_true (b, 2 * node + 1, lo + span / 2, span / 2, start);
+      return idx;
+    }
+  else
+    {
+      size_t end = lo + span < b->bit_cnt ? lo + span : b->bit_cnt;
+      size_t i = lo > start ? lo : start;
+
+      while (i < end)
+        {
+          elem_type e = b->bits[elem_idx (i)];
+          if (i % ELEM_BITS == 0 && e == 0)
+            i += ELEM_BITS;
+          else if (e & bit_mask (i))
+            return i;
+          else
+            i++;
+        }
+      return BITMAP_ERROR;
+    }
+}
 
 /* File input and output. */
 
@@ -346,6 +711,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      init_summary (b);
     }
   return success;
 }
@@ -358,6 +724,28 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds the CNT bits starting at START,
+   rounded out to whole elements, to the same place in FILE where
+   bitmap_write() would put it.  Bits past the end of B are
+   ignored.  Return true if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   size_t start, size_t cnt)
+{
+  size_t first, end;
+  off_t size;
+
+  if (start >= b->bit_cnt || cnt == 0)
+    return true;
+  if (cnt > b->bit_cnt - start)
+    cnt = b->bit_cnt - start;
+  first = elem_idx (start);
+  end = elem_cnt (start + cnt);
+  size = (end - first) * sizeof (elem_type);
+  return file_write_at (file, b->bits + first, size,
+                        first * sizeof (elem_type)) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
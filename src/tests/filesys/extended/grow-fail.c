@@ -0,0 +1,60 @@
+/* Fills the disk and frees it again, then tries to extend a file
+   past the end of the disk, through the rest of its direct blocks
+   and into its indirect blocks.  Checks that the failed write
+   leaves the file alone and gives back all the space it took, by
+   filling the disk a second time. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define VICTIM_SIZE 600
+
+static char buf[512];
+static char zeros[VICTIM_SIZE];
+
+/* Writes to a new file until the disk is full, removes the file,
+   and returns the number of blocks it held. */
+static size_t
+fill_disk (void)
+{
+  size_t block_cnt = 0;
+  int fd;
+
+  CHECK (create ("filler", 0), "create \"filler\"");
+  CHECK ((fd = open ("filler")) > 1, "open \"filler\"");
+  while (write (fd, buf, sizeof buf) == sizeof buf)
+    block_cnt++;
+  msg ("close \"filler\"");
+  close (fd);
+  CHECK (remove ("filler"), "remove \"filler\"");
+  return block_cnt;
+}
+
+void
+test_main (void) 
+{
+  size_t before, after;
+  int fd;
+
+  CHECK (create ("victim", VICTIM_SIZE), "create \"victim\"");
+  before = fill_disk ();
+  if (before == 0)
+    fail ("disk was already full");
+
+  CHECK ((fd = open ("victim")) > 1, "open \"victim\"");
+  msg ("seek \"victim\" past end of disk");
+  seek (fd, 4 * 1024 * 1024);
+  CHECK (write (fd, buf, 1) == 0, "write \"victim\" past end of disk");
+  CHECK (filesize (fd) == VICTIM_SIZE, "filesize \"victim\"");
+  msg ("close \"victim\"");
+  close (fd);
+
+  after = fill_disk ();
+  if (after != before)
+    fail ("disk held %zu blocks before the failed write but %zu after",
+          before, after);
+  msg ("free space unchanged");
+
+  check_file ("victim", zeros, VICTIM_SIZE);
+}
@@ -0,0 +1,27 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-fail) begin
+(grow-fail) create "victim"
+(grow-fail) create "filler"
+(grow-fail) open "filler"
+(grow-fail) close "filler"
+(grow-fail) remove "filler"
+(grow-fail) open "victim"
+(grow-fail) seek "victim" past end of disk
+(grow-fail) write "victim" past end of disk
+(grow-fail) filesize "victim"
+(grow-fail) close "victim"
+(grow-fail) create "filler"
+(grow-fail) open "filler"
+(grow-fail) close "filler"
+(grow-fail) remove "filler"
+(grow-fail) free space unchanged
+(grow-fail) open "victim" for verification
+(grow-fail) verified contents of "victim"
+(grow-fail) close "victim"
+(grow-fail) end
+EOF
+pass;
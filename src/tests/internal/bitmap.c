@@ -0,0 +1,150 @@
+/* Test program for searching in lib/kernel/bitmap.c.
+
+   Checks bitmap_scan() and bitmap_scan_and_flip(), which search
+   the bitmap's run-summary tree, against a naive bit-by-bit scan
+   of a plain array, on bitmaps of many sizes, including sizes
+   that are not a multiple of the tree's leaf width, after random
+   updates with bitmap_set() and bitmap_set_multiple().
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include "threads/test.h"
+
+/* Maximum number of bits in a bitmap that we will test. */
+#define MAX_BITS 3000
+
+/* Operations per bitmap. */
+#define OP_CNT 400
+
+/* Copy of the bitmap under test, one bool per bit. */
+static bool shadow[MAX_BITS];
+
+static size_t naive_scan (size_t bit_cnt, size_t start, size_t cnt,
+                          bool value);
+static void verify_bits (const struct bitmap *, size_t bit_cnt);
+static void random_op (struct bitmap *, size_t bit_cnt, int density);
+
+/* Test bitmap searching. */
+void
+test (void)
+{
+  size_t bit_cnt;
+
+  printf ("testing various size bitmaps:");
+  for (bit_cnt = 0; bit_cnt < MAX_BITS; bit_cnt = bit_cnt * 4 / 3 + 1)
+    {
+      int repeat;
+
+      printf (" %zu", bit_cnt);
+      for (repeat = 0; repeat < 10; repeat++)
+        {
+          struct bitmap *b = bitmap_create (bit_cnt);
+          int density = random_ulong () % 101;
+          size_t i;
+          int op;
+
+          ASSERT (b != NULL);
+          for (i = 0; i < bit_cnt; i++)
+            shadow[i] = false;
+          verify_bits (b, bit_cnt);
+
+          for (op = 0; op < OP_CNT; op++)
+            random_op (b, bit_cnt, density);
+          verify_bits (b, bit_cnt);
+          bitmap_destroy (b);
+        }
+    }
+
+  printf (" done\n");
+  printf ("bitmap: PASS\n");
+}
+
+/* Applies one random update or search to B, which has BIT_CNT
+   bits, and to the shadow array, and checks any search result
+   against a naive scan.  Bits are set to true DENSITY percent of
+   the time. */
+static void
+random_op (struct bitmap *b, size_t bit_cnt, int density)
+{
+  size_t start = random_ulong () % (bit_cnt + 1);
+  size_t cnt, idx, i;
+  bool value = (int) (random_ulong () % 100) < density;
+
+  switch (random_ulong () % 4)
+    {
+    case 0:
+      /* Set a range. */
+      cnt = random_ulong () % (bit_cnt - start + 1);
+      bitmap_set_multiple (b, start, cnt, value);
+      for (i = 0; i < cnt; i++)
+        shadow[start + i] = value;
+      break;
+
+    case 1:
+      /* Set a single bit. */
+      if (start < bit_cnt)
+        {
+          bitmap_set (b, start, value);
+          shadow[start] = value;
+        }
+      break;
+
+    case 2:
+      /* Search for a short or long run of either value. */
+      cnt = random_ulong () % (random_ulong () % 2 ? 5 : 300);
+      value = random_ulong () % 2;
+      ASSERT (bitmap_scan (b, start, cnt, value)
+              == naive_scan (bit_cnt, start, cnt, value));
+      break;
+
+    case 3:
+      /* Search for a run of false bits and claim it. */
+      cnt = 1 + random_ulong () % 40;
+      idx = bitmap_scan_and_flip (b, start, cnt, false);
+      ASSERT (idx == naive_scan (bit_cnt, start, cnt, false));
+      if (idx != BITMAP_ERROR)
+        for (i = 0; i < cnt; i++)
+          shadow[idx + i] = true;
+      break;
+    }
+}
+
+/* Returns the index of the first group of CNT bits in the shadow
+   array, which has BIT_CNT bits, at or after START that are all
+   VALUE, or BITMAP_ERROR if there is none. */
+static size_t
+naive_scan (size_t bit_cnt, size_t start, size_t cnt, bool value)
+{
+  size_t i, j;
+
+  if (cnt == 0)
+    return start;
+  for (i = start; i + cnt <= bit_cnt; i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (shadow[i + j] != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Verifies that B, which has BIT_CNT bits, matches the shadow
+   array bit for bit. */
+static void
+verify_bits (const struct bitmap *b, size_t bit_cnt)
+{
+  size_t i;
+
+  ASSERT (bitmap_size (b) == bit_cnt);
+  for (i = 0; i < bit_cnt; i++)
+    ASSERT (bitmap_test (b, i) == shadow[i]);
+}
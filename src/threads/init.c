@@ -33,9 +33,14 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "devices/ahci.h"
 #include "devices/ide.h"
+#include "devices/raid0.h"
+#include "devices/ramdisk.h"
+#include "devices/virtio-blk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -52,6 +57,19 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk, -ramdisk-load: Size of RAM disk in sectors, and
+   whether to copy the scratch device into it. */
+static block_sector_t ramdisk_sectors;
+static bool ramdisk_load;
+
+/* -raid0, -raid0-stripe: Block devices to stripe into md0, and
+   sectors per stripe. */
+static char *raid0_members;
+static block_sector_t raid0_stripe = RAID0_DEFAULT_STRIPE;
+
+/* -trace: Number of block I/O trace records to keep. */
+static size_t trace_records;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -122,7 +140,14 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  block_trace_init (trace_records);
   ide_init ();
+  ahci_init ();
+  virtio_blk_init ();
+  ramdisk_init (ramdisk_sectors, ramdisk_load, scratch_bdev_name);
+  raid0_init (raid0_members, raid0_stripe);
+  if (raid0_members != NULL && filesys_bdev_name == NULL)
+    filesys_bdev_name = "md0";
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -247,6 +272,46 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ramdisk"))
+        {
+          int sectors = value != NULL ? atoi (value) : 0;
+          if (sectors <= 0)
+            PANIC ("-ramdisk: size must be a positive number of sectors");
+          ramdisk_sectors = sectors;
+        }
+      else if (!strcmp (name, "-ramdisk-load"))
+        ramdisk_load = true;
+      else if (!strcmp (name, "-raid0"))
+        raid0_members = value;
+      else if (!strcmp (name, "-raid0-stripe"))
+        {
+          int sectors = value != NULL ? atoi (value) : 0;
+          if (sectors <= 0)
+            PANIC ("-raid0-stripe: stripe must be a positive number "
+                   "of sectors");
+          raid0_stripe = sectors;
+        }
+      else if (!strcmp (name, "-trace"))
+        {
+          int records = value != NULL ? atoi (value) : -1;
+          if (records < 0)
+            PANIC ("-trace: record count must not be negative");
+          trace_records = records;
+        }
+      else if (!strcmp (name, "-cache"))
+        {
+          int sectors = value != NULL ? atoi (value) : 0;
+          if (sectors <= 0 || sectors > CACHE_SECTORS_LIMIT)
+            PANIC ("-cache: size must be between 1 and %d sectors",
+                   CACHE_SECTORS_LIMIT);
+          cache_max_sectors = sectors;
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!cache_set_policy (value))
+            PANIC ("unknown cache policy \"%s\" (use \"clock\" or \"2q\")",
+                   value != NULL ? value : "");
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -373,6 +438,15 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -ramdisk=SECTORS   Create a SECTORS-sector RAM disk, ram0.\n"
+          "  -ramdisk-load      Copy scratch device into ram0 at startup.\n"
+          "  -raid0=BDEV,...    Stripe md0 across the listed BDEVs, none of\n"
+          "                     which may hold a Pintos partition, and use\n"
+          "                     md0 for file system unless -filesys is given.\n"
+          "  -raid0-stripe=SECTORS  Use SECTORS-sector stripes in md0 (default 16).\n"
+          "  -trace=RECORDS     Trace block I/O, dump last RECORDS to scratch.\n"
+          "  -cache=SECTORS     Let the buffer cache grow to SECTORS sectors.\n"
+          "  -cache-policy=POLICY  Replace cache sectors by clock (default) or 2q.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
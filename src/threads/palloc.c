@@ -36,6 +36,9 @@ struct pool
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+/* Gives back kernel pages under memory pressure, if non-null. */
+static palloc_reclaim_func *reclaim_func;
+
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
@@ -81,6 +84,16 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
   lock_release (&pool->lock);
 
+  /* If the kernel pool is exhausted, ask the reclaimer to give
+     pages back for as long as it can, retrying after each. */
+  while (page_idx == BITMAP_ERROR && pool == &kernel_pool
+         && reclaim_func != NULL && reclaim_func ())
+    {
+      lock_acquire (&pool->lock);
+      page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+      lock_release (&pool->lock);
+    }
+
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
   else
@@ -100,6 +113,16 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   return pages;
 }
 
+/* Sets FUNC as the function palloc_get_multiple() calls to
+   reclaim kernel pages when the kernel pool is exhausted.  FUNC
+   must not block waiting for a lock, because it may be called
+   by a thread that already holds one its owner needs. */
+void
+palloc_set_reclaim (palloc_reclaim_func *func)
+{
+  reclaim_func = func;
+}
+
 /* Obtains a single free page and returns its kernel virtual
    address.
    If PAL_USER is set, the page is obtained from the user pool,
@@ -1,6 +1,7 @@
 #ifndef THREADS_PALLOC_H
 #define THREADS_PALLOC_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /* How to allocate pages. */
@@ -11,7 +12,13 @@ enum palloc_flags
     PAL_USER = 004              /* User page. */
   };
 
+/* Called when the kernel pool is out of pages.  Should give back
+   at least one page and return true, or return false if it has
+   nothing left to give. */
+typedef bool palloc_reclaim_func (void);
+
 void palloc_init (size_t user_page_limit);
+void palloc_set_reclaim (palloc_reclaim_func *);
 void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
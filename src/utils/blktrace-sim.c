@@ -0,0 +1,614 @@
+/* blktrace-sim: replays a Pintos block I/O trace against
+   simulated buffer caches.
+
+   The trace is the "blktrace" file that the kernel writes to the
+   scratch device when run with -trace (see block_trace_dump() in
+   devices/block.c); "pintos --trace=FILE" copies it out of the VM.
+   Each buffer cache lookup in the trace is replayed, in order,
+   against caches of several sizes, each managed by several
+   replacement policies, and the hit ratio of each is printed, so
+   that the cache can be sized and tuned from one run. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Trace file format.  Must agree with devices/block.h. */
+#define TRACE_MAGIC "PINTRACE"
+#define TRACE_HEADER_SIZE 536   /* sizeof (struct block_trace_header). */
+#define TRACE_RECORD_SIZE 24    /* sizeof (struct block_trace_record). */
+#define TRACE_DEVICES 32        /* BLOCK_TRACE_DEVICES. */
+
+#define TRACE_WRITE 0x01        /* BLOCK_TRACE_WRITE. */
+#define TRACE_CACHE 0x02        /* BLOCK_TRACE_CACHE. */
+#define TRACE_HIT 0x04          /* BLOCK_TRACE_HIT. */
+#define TRACE_META 0x08         /* BLOCK_TRACE_META. */
+#define TRACE_PREFETCH 0x10     /* BLOCK_TRACE_PREFETCH. */
+
+/* A trace record, decoded. */
+struct record
+  {
+    int64_t ticks;
+    uint32_t sector;
+    uint32_t cnt;
+    int32_t tid;
+    uint8_t dev_no;
+    uint8_t flags;
+  };
+
+/* A trace, decoded. */
+struct trace
+  {
+    uint32_t lost_cnt;
+    uint32_t ticks_per_sec;
+    uint32_t device_cnt;
+    char devices[TRACE_DEVICES][17];
+    struct record *records;
+    size_t record_cnt;
+  };
+
+static const char *program_name;
+
+/* Prints an error message built from FORMAT and exits. */
+static void
+fail (const char *format, const char *arg)
+{
+  fprintf (stderr, "%s: ", program_name);
+  fprintf (stderr, format, arg);
+  fputc ('\n', stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Decodes little-endian integers. */
+static uint32_t
+get32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return get32 (p) | ((uint64_t) get32 (p + 4) << 32);
+}
+
+/* Reads the trace in FILE_NAME into T. */
+static void
+read_trace (const char *file_name, struct trace *t)
+{
+  unsigned char header[TRACE_HEADER_SIZE];
+  unsigned char buf[TRACE_RECORD_SIZE];
+  uint32_t record_cnt;
+  FILE *f;
+  size_t i;
+
+  f = fopen (file_name, "rb");
+  if (f == NULL)
+    fail ("%s: open failed", file_name);
+  if (fread (header, sizeof header, 1, f) != 1
+      || memcmp (header, TRACE_MAGIC, 8))
+    fail ("%s: not a Pintos block trace", file_name);
+
+  record_cnt = get32 (header + 8);
+  t->lost_cnt = get32 (header + 12);
+  t->ticks_per_sec = get32 (header + 16);
+  t->device_cnt = get32 (header + 20);
+  if (t->device_cnt > TRACE_DEVICES)
+    t->device_cnt = TRACE_DEVICES;
+  for (i = 0; i < TRACE_DEVICES; i++)
+    {
+      memcpy (t->devices[i], header + 24 + 16 * i, 16);
+      t->devices[i][16] = '\0';
+    }
+
+  t->records = malloc ((record_cnt ? record_cnt : 1) * sizeof *t->records);
+  if (t->records == NULL)
+    fail ("%s: out of memory", file_name);
+  for (t->record_cnt = 0; t->record_cnt < record_cnt; t->record_cnt++)
+    {
+      struct record *r = &t->records[t->record_cnt];
+      if (fread (buf, sizeof buf, 1, f) != 1)
+        {
+          fprintf (stderr, "%s: %s: truncated after %zu of %lu records\n",
+                   program_name, file_name, t->record_cnt,
+                   (unsigned long) record_cnt);
+          break;
+        }
+      r->ticks = get64 (buf);
+      r->sector = get32 (buf + 8);
+      r->cnt = get32 (buf + 12);
+      r->tid = get32 (buf + 16);
+      r->dev_no = buf[20];
+      r->flags = buf[21];
+    }
+  fclose (f);
+}
+
+/* Simulated caches. */
+
+enum policy
+  {
+    POLICY_CLOCK,               /* Clock (second chance). */
+    POLICY_LRU,                 /* Least recently used. */
+    POLICY_ARC,                 /* Adaptive replacement cache. */
+    POLICY_CNT
+  };
+
+static const char *policy_names[POLICY_CNT] = { "clock", "lru", "arc" };
+
+/* A cached or remembered block. */
+struct entry
+  {
+    uint64_t key;               /* Device number and sector. */
+    struct entry *hash_next;    /* Next in hash bucket. */
+    struct entry *prev, *next;  /* Neighbors in list. */
+    int list;                   /* List it is on. */
+    bool ref;                   /* Clock reference bit. */
+  };
+
+/* A list of entries, most recently used first. */
+struct list
+  {
+    struct entry head;          /* Sentinel. */
+    size_t size;
+  };
+
+/* ARC's lists.  Clock and LRU use only T1. */
+enum { T1, T2, B1, B2, LIST_CNT };
+
+/* A simulated cache. */
+struct sim
+  {
+    enum policy policy;
+    size_t capacity;            /* Blocks it can hold. */
+    struct entry **buckets;     /* Hash table. */
+    size_t bucket_cnt;
+    struct entry *entries;      /* All entries. */
+    struct entry *pool;         /* Unused entries, through NEXT. */
+    struct list lists[LIST_CNT];
+    struct entry *hand;         /* Clock hand, in T1. */
+    size_t p;                   /* ARC target size of T1. */
+    unsigned long long hits, misses;
+  };
+
+static void
+list_init (struct list *l)
+{
+  l->head.prev = l->head.next = &l->head;
+  l->size = 0;
+}
+
+static void
+list_remove (struct sim *s, struct entry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  s->lists[e->list].size--;
+}
+
+/* Inserts E into list LIST just before BEFORE. */
+static void
+list_insert (struct sim *s, int list, struct entry *before, struct entry *e)
+{
+  e->prev = before->prev;
+  e->next = before;
+  before->prev->next = e;
+  before->prev = e;
+  e->list = list;
+  s->lists[list].size++;
+}
+
+static void
+list_push_front (struct sim *s, int list, struct entry *e)
+{
+  list_insert (s, list, s->lists[list].head.next, e);
+}
+
+static struct entry *
+list_back (struct sim *s, int list)
+{
+  return s->lists[list].head.prev;
+}
+
+static struct entry **
+bucket (struct sim *s, uint64_t key)
+{
+  return &s->buckets[(key * 0x9e3779b97f4a7c15ULL >> 32) % s->bucket_cnt];
+}
+
+static struct entry *
+lookup (struct sim *s, uint64_t key)
+{
+  struct entry *e;
+
+  for (e = *bucket (s, key); e != NULL; e = e->hash_next)
+    if (e->key == key)
+      return e;
+  return NULL;
+}
+
+/* Takes an entry from the pool and gives it KEY. */
+static struct entry *
+entry_new (struct sim *s, uint64_t key)
+{
+  struct entry *e = s->pool;
+  struct entry **b = bucket (s, key);
+
+  s->pool = e->next;
+  e->key = key;
+  e->ref = false;
+  e->hash_next = *b;
+  *b = e;
+  return e;
+}
+
+/* Removes E from its list and the hash table and returns it to
+   the pool. */
+static void
+entry_delete (struct sim *s, struct entry *e)
+{
+  struct entry **b;
+
+  list_remove (s, e);
+  for (b = bucket (s, e->key); *b != e; b = &(*b)->hash_next)
+    continue;
+  *b = e->hash_next;
+  e->next = s->pool;
+  s->pool = e;
+}
+
+static void
+sim_init (struct sim *s, enum policy policy, size_t capacity)
+{
+  size_t entry_cnt = 2 * capacity + 1;
+  size_t i;
+
+  s->policy = policy;
+  s->capacity = capacity;
+  s->bucket_cnt = entry_cnt;
+  s->buckets = calloc (s->bucket_cnt, sizeof *s->buckets);
+  s->entries = malloc (entry_cnt * sizeof *s->entries);
+  if (s->buckets == NULL || s->entries == NULL)
+    fail ("%s", "out of memory");
+  for (i = 0; i + 1 < entry_cnt; i++)
+    s->entries[i].next = &s->entries[i + 1];
+  s->entries[entry_cnt - 1].next = NULL;
+  s->pool = s->entries;
+  for (i = 0; i < LIST_CNT; i++)
+    list_init (&s->lists[i]);
+  s->hand = &s->lists[T1].head;
+  s->p = 0;
+  s->hits = s->misses = 0;
+}
+
+/* Clock.  T1 is the circle, and new blocks go in just behind the
+   hand. */
+static bool
+clock_access (struct sim *s, uint64_t key)
+{
+  struct entry *e = lookup (s, key);
+
+  if (e != NULL)
+    {
+      e->ref = true;
+      return true;
+    }
+  if (s->lists[T1].size == s->capacity)
+    {
+      for (;;)
+        {
+          if (s->hand == &s->lists[T1].head)
+            s->hand = s->hand->next;
+          if (!s->hand->ref)
+            break;
+          s->hand->ref = false;
+          s->hand = s->hand->next;
+        }
+      e = s->hand;
+      s->hand = e->next;
+      entry_delete (s, e);
+    }
+  e = entry_new (s, key);
+  list_insert (s, T1, s->hand, e);
+  e->ref = true;
+  return false;
+}
+
+/* LRU.  T1 is in recency order. */
+static bool
+lru_access (struct sim *s, uint64_t key)
+{
+  struct entry *e = lookup (s, key);
+
+  if (e != NULL)
+    {
+      list_remove (s, e);
+      list_push_front (s, T1, e);
+      return true;
+    }
+  if (s->lists[T1].size == s->capacity)
+    entry_delete (s, list_back (s, T1));
+  list_push_front (s, T1, entry_new (s, key));
+  return false;
+}
+
+/* ARC's REPLACE: demotes the LRU block of T1 or of T2 to the
+   matching ghost list. */
+static void
+arc_replace (struct sim *s, bool in_b2)
+{
+  size_t t1 = s->lists[T1].size;
+  struct entry *e;
+
+  if (t1 > 0 && ((in_b2 && t1 == s->p) || t1 > s->p))
+    {
+      e = list_back (s, T1);
+      list_remove (s, e);
+      list_push_front (s, B1, e);
+    }
+  else
+    {
+      e = list_back (s, T2);
+      list_remove (s, e);
+      list_push_front (s, B2, e);
+    }
+}
+
+/* ARC [Megiddo and Modha, FAST 2003]. */
+static bool
+arc_access (struct sim *s, uint64_t key)
+{
+  size_t c = s->capacity;
+  size_t t1 = s->lists[T1].size, t2 = s->lists[T2].size;
+  size_t b1 = s->lists[B1].size, b2 = s->lists[B2].size;
+  struct entry *e = lookup (s, key);
+
+  if (e != NULL && (e->list == T1 || e->list == T2))
+    {
+      list_remove (s, e);
+      list_push_front (s, T2, e);
+      return true;
+    }
+  if (e != NULL && e->list == B1)
+    {
+      size_t delta = b1 >= b2 ? 1 : b2 / b1;
+      s->p = s->p + delta < c ? s->p + delta : c;
+      arc_replace (s, false);
+      list_remove (s, e);
+      list_push_front (s, T2, e);
+      return false;
+    }
+  if (e != NULL && e->list == B2)
+    {
+      size_t delta = b2 >= b1 ? 1 : b1 / b2;
+      s->p = s->p > delta ? s->p - delta : 0;
+      arc_replace (s, true);
+      list_remove (s, e);
+      list_push_front (s, T2, e);
+      return false;
+    }
+
+  if (t1 + b1 == c)
+    {
+      if (t1 < c)
+        {
+          entry_delete (s, list_back (s, B1));
+          arc_replace (s, false);
+        }
+      else
+        entry_delete (s, list_back (s, T1));
+    }
+  else if (t1 + t2 + b1 + b2 >= c)
+    {
+      if (t1 + t2 + b1 + b2 == 2 * c)
+        entry_delete (s, list_back (s, B2));
+      arc_replace (s, false);
+    }
+  list_push_front (s, T1, entry_new (s, key));
+  return false;
+}
+
+/* Replays an access to KEY in S, counting it as a hit or a miss
+   if COUNT is true. */
+static void
+sim_access (struct sim *s, uint64_t key, bool count)
+{
+  bool hit = false;
+
+  switch (s->policy)
+    {
+    case POLICY_CLOCK:
+      hit = clock_access (s, key);
+      break;
+    case POLICY_LRU:
+      hit = lru_access (s, key);
+      break;
+    case POLICY_ARC:
+      hit = arc_access (s, key);
+      break;
+    default:
+      abort ();
+    }
+  if (count)
+    {
+      if (hit)
+        s->hits++;
+      else
+        s->misses++;
+    }
+}
+
+static void
+usage (void)
+{
+  printf ("%s: replays a Pintos block I/O trace against simulated caches\n"
+          "usage: %s [OPTION...] TRACE\n"
+          "  -s SIZES     Comma-separated cache sizes in sectors\n"
+          "               (default: 16,32,64,128,256,512,1024)\n"
+          "  -p POLICIES  Comma-separated policies among clock, lru, arc\n"
+          "               (default: all)\n"
+          "  -d DEVICE    Only replay accesses to DEVICE\n"
+          "  -r           Replay device requests, sector by sector, instead\n"
+          "               of buffer cache lookups\n"
+          "  -h           Print this help\n",
+          program_name, program_name);
+  exit (EXIT_SUCCESS);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char default_sizes[] = "16,32,64,128,256,512,1024";
+  char *sizes_arg = default_sizes;
+  char *policies_arg = NULL;
+  const char *device = NULL;
+  bool replay_requests = false;
+  bool policies[POLICY_CNT];
+  size_t sizes[64];
+  size_t size_cnt = 0;
+  struct trace t;
+  unsigned long long lookups = 0, recorded_hits = 0;
+  unsigned long long reads = 0, writes = 0;
+  int dev_no = -1;
+  char *tok, *save_ptr;
+  size_t i, j, k;
+  int opt;
+
+  program_name = argv[0];
+  while ((opt = getopt (argc, argv, "s:p:d:rh")) != -1)
+    switch (opt)
+      {
+      case 's':
+        sizes_arg = optarg;
+        break;
+      case 'p':
+        policies_arg = optarg;
+        break;
+      case 'd':
+        device = optarg;
+        break;
+      case 'r':
+        replay_requests = true;
+        break;
+      case 'h':
+        usage ();
+        break;
+      default:
+        exit (EXIT_FAILURE);
+      }
+  if (optind + 1 != argc)
+    fail ("%s", "exactly one trace file required (use -h for help)");
+
+  for (tok = strtok_r (sizes_arg, ",", &save_ptr); tok != NULL;
+       tok = strtok_r (NULL, ",", &save_ptr))
+    {
+      long size = strtol (tok, NULL, 10);
+      if (size <= 0)
+        fail ("%s: bad cache size", tok);
+      if (size_cnt < sizeof sizes / sizeof *sizes)
+        sizes[size_cnt++] = size;
+    }
+  for (i = 0; i < POLICY_CNT; i++)
+    policies[i] = policies_arg == NULL;
+  if (policies_arg != NULL)
+    for (tok = strtok_r (policies_arg, ",", &save_ptr); tok != NULL;
+         tok = strtok_r (NULL, ",", &save_ptr))
+      {
+        for (i = 0; i < POLICY_CNT; i++)
+          if (!strcmp (tok, policy_names[i]))
+            break;
+        if (i == POLICY_CNT)
+          fail ("%s: unknown policy", tok);
+        policies[i] = true;
+      }
+
+  read_trace (argv[optind], &t);
+  if (device != NULL)
+    {
+      for (i = 0; i < t.device_cnt; i++)
+        if (!strcmp (t.devices[i], device))
+          dev_no = i;
+      if (dev_no < 0)
+        fail ("%s: device not in trace", device);
+    }
+
+  /* Summarize the trace. */
+  for (i = 0; i < t.record_cnt; i++)
+    {
+      const struct record *r = &t.records[i];
+      if (dev_no >= 0 && r->dev_no != dev_no)
+        continue;
+      if (r->flags & TRACE_CACHE)
+        {
+          if (!(r->flags & TRACE_PREFETCH))
+            {
+              lookups++;
+              if (r->flags & TRACE_HIT)
+                recorded_hits++;
+            }
+        }
+      else if (r->flags & TRACE_WRITE)
+        writes += r->cnt;
+      else
+        reads += r->cnt;
+    }
+  printf ("%zu records", t.record_cnt);
+  if (t.lost_cnt > 0)
+    printf (" (%lu older records lost)", (unsigned long) t.lost_cnt);
+  if (t.record_cnt > 0 && t.ticks_per_sec > 0)
+    printf (" over %.2f s",
+            (double) (t.records[t.record_cnt - 1].ticks - t.records[0].ticks)
+            / t.ticks_per_sec);
+  printf ("\ndevice requests: %llu sectors read, %llu written\n",
+          reads, writes);
+  if (lookups > 0)
+    printf ("cache lookups: %llu, recorded hit ratio %.2f%%\n",
+            lookups, 100.0 * recorded_hits / lookups);
+
+  /* Replay against each size and policy. */
+  printf ("\n%8s", "sectors");
+  for (k = 0; k < POLICY_CNT; k++)
+    if (policies[k])
+      printf (" %8s", policy_names[k]);
+  printf ("\n");
+  for (j = 0; j < size_cnt; j++)
+    {
+      printf ("%8zu", sizes[j]);
+      for (k = 0; k < POLICY_CNT; k++)
+        {
+          struct sim s;
+          unsigned long long total;
+
+          if (!policies[k])
+            continue;
+          sim_init (&s, k, sizes[j]);
+          for (i = 0; i < t.record_cnt; i++)
+            {
+              const struct record *r = &t.records[i];
+              uint64_t key = (uint64_t) r->dev_no << 32;
+              uint32_t n;
+
+              if (dev_no >= 0 && r->dev_no != dev_no)
+                continue;
+              if (replay_requests)
+                {
+                  if (!(r->flags & TRACE_CACHE))
+                    for (n = 0; n < r->cnt; n++)
+                      sim_access (&s, key | (r->sector + n), true);
+                }
+              else if (r->flags & TRACE_CACHE)
+                sim_access (&s, key | r->sector,
+                            !(r->flags & TRACE_PREFETCH));
+            }
+          total = s.hits + s.misses;
+          printf (" %7.2f%%", total ? 100.0 * s.hits / total : 0.0);
+          free (s.buckets);
+          free (s.entries);
+        }
+      printf ("\n");
+    }
+  return EXIT_SUCCESS;
+}